@@ -0,0 +1,188 @@
+#include "bench.h"
+#include "mem.h"
+#include "kmem.h"
+#include "kprint.h"
+#include "util.h"
+#include "sched.h"
+#include "exec.h"
+#include "cpu.h"
+
+// Every size is copied enough times to move this many bytes in total
+#define BENCH_TOTAL_BYTES 0x400000
+
+// The byte-at-a-time loops memcpy and memset used to be, kept as a baseline. The volatile target
+// stops the compiler from turning them back into calls to the routines being measured.
+void* memcpy_bytes(void* dest, const void* src, size_t size) {
+  volatile char* target = (volatile char*) dest;
+  const char* source = (const char*) src;
+  for (size_t i = 0; i < size; i++) {
+    target[i] = source[i];
+  }
+
+  return dest;
+}
+
+void* memset_bytes(void* ptr, int c, size_t n) {
+  volatile unsigned char* curr = ptr;
+  for (size_t i = 0; i < n; i++) {
+    curr[i] = (unsigned char) c;
+  }
+
+  return ptr;
+}
+
+// Convert a cycle count for BENCH_TOTAL_BYTES into bytes per thousand cycles
+uint64_t bytes_per_kcycle(uint64_t cycles) {
+  return (cycles == 0) ? 0 : (uint64_t) BENCH_TOTAL_BYTES * 1000 / cycles;
+}
+
+// Print each CPU's page magazine counters, with the share of allocations it served itself
+void print_magazine_stats() {
+  kprint_f("cpu  page allocs  hit rate  refills  frees  spills  cached\n");
+
+  for (uint32_t cpu = 0; cpu < cpu_count; cpu++) {
+    pmem_magazine_stats_t stats;
+    pmem_get_magazine_stats(cpu, &stats);
+
+    kprint_f("%d  %d  %d%%  %d  %d  %d  %d\n", cpu, stats.allocs,
+             stats.allocs == 0 ? 0 : stats.hits * 100 / stats.allocs, stats.refills, stats.frees,
+             stats.spills, stats.cached);
+  }
+}
+
+void mem_benchmark() {
+  // Two 1 MiB buffers from one contiguous 2 MiB block
+  uintptr_t block = pmem_alloc_pages(9);
+
+  if (block == 0) {
+    kprint_f("mem_benchmark: out of memory\n");
+    return;
+  }
+
+  char* src = (char*) ptov((void*) block);
+  char* dest = src + 0x100000;
+
+  kprint_f("size      memcpy old/new (bytes per 1000 cycles)   memset old/new\n");
+
+  for (size_t size = 16; size <= 0x100000; size *= 4) {
+    size_t iterations = BENCH_TOTAL_BYTES / size;
+    uint64_t start;
+
+    start = rdtsc();
+    for (size_t i = 0; i < iterations; i++) {
+      memcpy_bytes(dest, src, size);
+    }
+    uint64_t copy_old = rdtsc() - start;
+
+    start = rdtsc();
+    for (size_t i = 0; i < iterations; i++) {
+      memcpy(dest, src, size);
+    }
+    uint64_t copy_new = rdtsc() - start;
+
+    start = rdtsc();
+    for (size_t i = 0; i < iterations; i++) {
+      memset_bytes(dest, (int) i, size);
+    }
+    uint64_t set_old = rdtsc() - start;
+
+    start = rdtsc();
+    for (size_t i = 0; i < iterations; i++) {
+      memset(dest, (int) i, size);
+    }
+    uint64_t set_new = rdtsc() - start;
+
+    kprint_f("%d: %d / %d   %d / %d\n", size,
+             bytes_per_kcycle(copy_old), bytes_per_kcycle(copy_new),
+             bytes_per_kcycle(set_old), bytes_per_kcycle(set_new));
+  }
+
+  pmem_free_pages(block, 9);
+
+  print_magazine_stats();
+  kmem_print_stats();
+}
+
+// The module the TLB benchmark runs, which times its own system call round trips
+#define TLB_BENCH_MODULE "sysbench"
+
+// Run the benchmark module to completion and print how long loading it and running it took
+void tlb_bench_exec(exec_image_t* image) {
+  uint64_t start = rdtsc();
+  process_t* child = proc_spawn(image, current_process);
+  uint64_t loaded = rdtsc();
+
+  if (child == NULL) {
+    kprint_f("tlb_benchmark: could not start %s\n", TLB_BENCH_MODULE);
+    return;
+  }
+
+  proc_wait(child);
+  uint64_t finished = rdtsc();
+
+  kprint_f("exec: %d cycles to load, %d cycles from spawn to exit\n", loaded - start,
+           finished - start);
+}
+
+void tlb_benchmark() {
+  exec_image_t* image = exec_find(TLB_BENCH_MODULE);
+
+  if (image == NULL) {
+    kprint_f("tlb_benchmark: no %s module\n", TLB_BENCH_MODULE);
+    return;
+  }
+
+  if (!vm_set_pcid_reuse(true)) {
+    kprint_f("tlb_benchmark: this CPU has no PCIDs, so both runs flush on every switch\n");
+  }
+
+  kprint_f("%s with PCIDs:\n", TLB_BENCH_MODULE);
+  tlb_bench_exec(image);
+
+  // Every switch now flushes the entries of the address space it loads, as without PCIDs
+  vm_set_pcid_reuse(false);
+  kprint_f("%s without PCIDs:\n", TLB_BENCH_MODULE);
+  tlb_bench_exec(image);
+  vm_set_pcid_reuse(true);
+}
+
+// Yields per kernel process in the scheduler benchmark
+#define SCHED_BENCH_YIELDS 10000
+
+// Yield back and forth with the other benchmark process
+void sched_bench_worker(void* arg) {
+  for (size_t i = 0; i < SCHED_BENCH_YIELDS; i++) {
+    sched_yield();
+  }
+}
+
+void sched_benchmark() {
+  sched_stats_t before;
+  sched_stats_t after;
+
+  sched_get_stats(&before);
+  uint64_t start = rdtsc();
+
+  process_t* a = proc_spawn_kernel(sched_bench_worker, NULL, current_process);
+  process_t* b = proc_spawn_kernel(sched_bench_worker, NULL, current_process);
+
+  if (a == NULL || b == NULL) {
+    kprint_f("sched_benchmark: could not create processes\n");
+    return;
+  }
+
+  proc_wait(a);
+  proc_wait(b);
+
+  uint64_t elapsed = rdtsc() - start;
+  sched_get_stats(&after);
+
+  uint64_t switches = after.switches - before.switches;
+  uint64_t latency = after.total_cycles - before.total_cycles;
+
+  kprint_f("%d context switches between kernel processes\n", switches);
+  kprint_f("switch latency: %d cycles average, %d max; %d cycles per yield round trip\n",
+           switches == 0 ? 0 : latency / switches, after.max_cycles,
+           elapsed / SCHED_BENCH_YIELDS);
+  kprint_f("%d processes stolen by idle CPUs\n", after.steals - before.steals);
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Print the throughput of memcpy and memset against the original byte-at-a-time loops, then each
+// CPU's page magazine counters and every slab cache's statistics
+void mem_benchmark();
+
+// Print the cost of exec'ing a module and of its system call round trips with PCIDs in use and
+// with every address space switch flushing as it would without them
+void tlb_benchmark();
+
+// Print the latency of context switches between two kernel processes yielding to each other
+void sched_benchmark();
@@ -15,6 +15,25 @@
 #include "usermode_entry.h"
 #include "syscallC.h"
 #include "exec.h"
+#include "bench.h"
+#include "kmem.h"
+#include "proc.h"
+#include "sched.h"
+#include "timer.h"
+#include "cpu.h"
+#include "lapic.h"
+#include "smp.h"
+#include "lock.h"
+#include "vdso.h"
+
+// Set to 1 to print the throughput of the kernel memory routines and allocator counters at boot
+#define BOOT_MEM_BENCHMARK 0
+
+// Set to 1 to print exec and system call latency with and without PCIDs at boot
+#define BOOT_TLB_BENCHMARK 0
+
+// Set to 1 to print the latency of context switches between kernel processes at boot
+#define BOOT_SCHED_BENCHMARK 0
 
 // Reserve space for the stack
 static uint8_t stack[8192];
@@ -24,11 +43,20 @@ static struct stivale2_tag unmap_null_hdr_tag = {
   .next = 0
 };
 
+// Ask the bootloader to park the application processors where smp_init() can start them
+static struct stivale2_header_tag_smp smp_hdr_tag = {
+  .tag = {
+    .identifier = STIVALE2_HEADER_TAG_SMP_ID,
+    .next = (uint64_t) &unmap_null_hdr_tag
+  },
+  .flags = 0
+};
+
 // Request a terminal from the bootloader
 static struct stivale2_header_tag_terminal terminal_hdr_tag = {
 	.tag = {
     .identifier = STIVALE2_HEADER_TAG_TERMINAL_ID,
-    .next = (uint64_t) &unmap_null_hdr_tag
+    .next = (uint64_t) &smp_hdr_tag
   },
   .flags = 0
 };
@@ -78,21 +106,98 @@ void pic_setup() {
   pic_unmask_irq(1);
 }
 
+// Boot phases are timed with the TSC and reported once the terminal is usable
+#define MAX_BOOT_PHASES 16
+
+typedef struct boot_phase {
+  const char* name;
+  uint64_t cycles;
+} boot_phase_t;
+
+boot_phase_t boot_phases[MAX_BOOT_PHASES];
+size_t boot_phase_count = 0;
+uint64_t boot_phase_start = 0;
+
+// Record the time since the previous phase ended under the given name
+void boot_phase(const char* name) {
+  uint64_t now = rdtsc();
+
+  if (boot_phase_count < MAX_BOOT_PHASES) {
+    boot_phases[boot_phase_count].name = name;
+    boot_phases[boot_phase_count].cycles = now - boot_phase_start;
+    boot_phase_count++;
+  }
+
+  boot_phase_start = rdtsc();
+}
+
+void boot_report() {
+  for (size_t i = 0; i < boot_phase_count; i++) {
+    kprint_f("boot: %s took %d cycles\n", boot_phases[i].name, boot_phases[i].cycles);
+  }
+}
+
 void _start(struct stivale2_struct* hdr) {
 
   // setup various parts of the kernel
+  boot_phase_start = rdtsc();
+  cpu_init(0, 0);
+  mem_features_init();
   idt_setup();
+  boot_phase("idt_setup");
   initialize_memory(find_tag(hdr, STIVALE2_STRUCT_TAG_MEMMAP_ID), find_tag(hdr, STIVALE2_STRUCT_TAG_HHDM_ID));
+  boot_phase("initialize_memory");
+  kmem_init();
   term_init();
+  boot_phase("term_init");
+
+  // Nothing else allocates from the slab allocator at boot, so check it before anything does
+  if (!kmem_self_test()) {
+    halt();
+  }
   unmap_lower_half();
+  tlb_setup();
+  boot_phase("unmap_lower_half");
   pic_setup();
   gdt_setup();
   syscall_setup();
+  boot_phase("pic/gdt/syscall setup");
   exec_setup(find_tag(hdr, STIVALE2_STRUCT_TAG_MODULES_ID));
+  boot_phase("exec_setup");
+  sched_init();
+  timer_setup(TIMER_HZ);
+  lapic_init();
+  lapic_timer_calibrate();
+  vdso_init();
+  boot_phase("sched/timer setup");
+  smp_init(find_tag(hdr, STIVALE2_STRUCT_TAG_SMP_ID));
+  boot_phase("smp_init");
+  boot_report();
+
+#if BOOT_MEM_BENCHMARK
+  mem_benchmark();
+#endif
+
+#if BOOT_TLB_BENCHMARK
+  tlb_benchmark();
+#endif
+
+#if BOOT_SCHED_BENCHMARK
+  sched_benchmark();
+#endif
+
+#if LOCK_STATS
+  lock_report();
+#endif
 
   // start the shell up for the user
-  uint64_t shell_start = locate_module("shell");
-  exec(shell_start);
+  process_t* shell = proc_spawn(exec_find("shell"), NULL);
+
+  if (shell == NULL) {
+    kprint_f("could not start the shell\n");
+    halt();
+  }
 
-	halt();
+  // The boot stack becomes the idle process, running whenever nothing else is ready
+  sched_idle();
 }
\ No newline at end of file
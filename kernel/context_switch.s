@@ -0,0 +1,31 @@
+.global context_switch
+
+# Switch kernel stacks between two threads of execution
+# Arguments are:
+#  where to save the current stack pointer (in %rdi)
+#  the stack pointer to switch to (in %rsi)
+# The callee-saved registers are kept on each stack, so the switch looks like an ordinary
+# function return to whoever saved the stack we switch to.
+context_switch:
+  # Save the callee-saved registers on the current stack
+  push %rbx
+  push %rbp
+  push %r12
+  push %r13
+  push %r14
+  push %r15
+
+  # Swap stacks
+  mov %rsp, (%rdi)
+  mov %rsi, %rsp
+
+  # Restore the registers saved on the new stack
+  pop %r15
+  pop %r14
+  pop %r13
+  pop %r12
+  pop %rbp
+  pop %rbx
+
+  # Return to wherever the new stack was switched away from
+  retq
@@ -0,0 +1,22 @@
+#include "cpu.h"
+
+#include <stddef.h>
+
+// syscall_fast_entry reaches these through %gs at fixed offsets
+_Static_assert(offsetof(cpu_t, kernel_stack_top) == 8, "kernel_stack_top must be at %gs:8");
+_Static_assert(offsetof(cpu_t, user_rsp) == 16, "user_rsp must be at %gs:16");
+
+cpu_t cpus[MAX_CPUS];
+uint32_t cpu_count = 1;
+
+void cpu_init(uint32_t id, uint32_t lapic_id) {
+  cpu_t* cpu = &cpus[id];
+
+  cpu->self = cpu;
+  cpu->id = id;
+  cpu->lapic_id = lapic_id;
+
+  // User code starts with a zero GS base, which swapgs brings in on the way out of the kernel
+  wrmsr(MSR_GS_BASE, (uintptr_t) cpu);
+  wrmsr(MSR_KERNEL_GS_BASE, 0);
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// The most CPUs the kernel keeps per-CPU state for
+#define MAX_CPUS 16
+
+// Model-specific registers holding the GS base in use and the one swapgs exchanges it with
+#define MSR_GS_BASE 0xC0000101
+#define MSR_KERNEL_GS_BASE 0xC0000102
+
+struct process;
+struct vm_space;
+
+// State private to one CPU. While in the kernel, GS base points to the running CPU's cpu_t; user
+// code runs with its own GS base, and every entry from user mode swaps them with swapgs.
+typedef struct cpu {
+  struct cpu* self;             // Must stay first: this_cpu() reads it through %gs:0
+  uintptr_t kernel_stack_top;   // Must stay at %gs:8: syscall_fast_entry switches to it
+  uintptr_t user_rsp;           // Must stay at %gs:16: syscall_fast_entry saves the user stack here
+  uint32_t id;
+  uint32_t lapic_id;
+  volatile bool online;
+  struct process* current;      // The process running on this CPU
+  struct process* idle;         // This CPU's idle process
+  struct process* prev;         // The process the switch in progress is leaving
+  struct vm_space* space;       // The regions of the running process's address space
+  uintptr_t loaded_root;        // The address space loaded in CR3
+  volatile uintptr_t drop_root; // An address space another CPU wants this one to stop using
+  uint64_t switch_start;        // When the context switch in progress started
+  volatile bool need_resched;
+} cpu_t;
+
+extern cpu_t cpus[MAX_CPUS];
+extern uint32_t cpu_count;
+
+// The running CPU's state. Never cache the result across a point where the process may switch
+// CPUs, such as schedule().
+static inline cpu_t* this_cpu() {
+  cpu_t* cpu;
+  __asm__ volatile("mov %%gs:0, %0" : "=r"(cpu));
+  return cpu;
+}
+
+// Index of the CPU running this code
+static inline uint32_t cpu_id() {
+  return this_cpu()->id;
+}
+
+// Exchange the user and kernel GS bases. Entry paths call this when they interrupted user mode,
+// and again before returning to it.
+static inline void swapgs() {
+  __asm__ volatile("swapgs" : : : "memory");
+}
+
+static inline uint64_t rdmsr(uint32_t msr) {
+  uint32_t low;
+  uint32_t high;
+  __asm__ volatile("rdmsr" : "=a"(low), "=d"(high) : "c"(msr));
+  return ((uint64_t) high << 32) | low;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t value) {
+  __asm__ volatile("wrmsr" : : "c"(msr), "a"((uint32_t) value), "d"((uint32_t) (value >> 32)));
+}
+
+/**
+ * Point the calling CPU's GS base at its cpu_t. Must run on each CPU before anything that uses
+ * per-CPU data.
+ * \param id The CPU's index in cpus
+ * \param lapic_id The CPU's local APIC ID
+ */
+void cpu_init(uint32_t id, uint32_t lapic_id);
@@ -1,5 +1,13 @@
 #include <stdint.h>
 
+// Program header types
+#define PT_LOAD 1
+
+// Program header segment permission flags
+#define PF_X 0x1
+#define PF_W 0x2
+#define PF_R 0x4
+
 typedef struct elf64_hdr {
     unsigned char e_ident[16]; /* ELF identification */
     uint16_t e_type; /* Object file type */
@@ -5,6 +5,9 @@
 #include "exception.h"
 #include "kprint.h"
 #include "mem.h"
+#include "region.h"
+#include "proc.h"
+#include "cpu.h"
 
 // Make an IDT
 idt_entry_t idt[256];
@@ -92,6 +95,36 @@ void interrupt_handler_ec(interrupt_context_t* ctx, uint64_t ec) {
   halt();
 }
 
+// handles page faults, which are resolved by demand paging when the address is reserved
+__attribute__((interrupt))
+void page_fault_handler(interrupt_context_t* ctx, uint64_t ec) {
+
+  uintptr_t address;
+  __asm__("mov %%cr2, %0" : "=r" (address));
+
+  bool from_user = (ctx->cs & 3) == 3;
+
+  if (from_user) {
+    swapgs();
+  }
+
+  if (vm_handle_fault(address, ec)) {
+    if (from_user) {
+      swapgs();
+    }
+    return;
+  }
+
+  kprint_f("Page Fault Interrupt at %p (ec=%d, ip=%p)\n", address, ec, ctx->ip);
+
+  // A bad user access only ends the process that made it
+  if (from_user && current_process->parent != NULL) {
+    proc_exit(-1);
+  }
+
+  halt();
+}
+
 void idt_set_handler(uint8_t index, void* fn, uint8_t type) {
 
   idt[index].type = type;
@@ -140,7 +173,7 @@ void idt_setup() {
   idt_set_handler(11, interrupt_handler_ec, IDT_TYPE_TRAP);
   idt_set_handler(12, interrupt_handler_ec, IDT_TYPE_TRAP);
   idt_set_handler(13, interrupt_handler_ec, IDT_TYPE_TRAP);
-  idt_set_handler(14, interrupt_handler_ec, IDT_TYPE_TRAP);
+  idt_set_handler(14, page_fault_handler, IDT_TYPE_INTERRUPT);
   idt_set_handler(15, interrupt_handler, IDT_TYPE_TRAP);
   idt_set_handler(16, interrupt_handler, IDT_TYPE_TRAP);
   idt_set_handler(17, interrupt_handler_ec, IDT_TYPE_TRAP);
@@ -150,6 +183,11 @@ void idt_setup() {
   idt_set_handler(21, interrupt_handler_ec, IDT_TYPE_TRAP);
 
   // Step 3: Install the IDT
+  idt_load();
+}
+
+// Load the shared IDT on the calling CPU. Application processors call this directly.
+void idt_load() {
   idt_record_t record = {
     .size = sizeof(idt),
     .base = idt
@@ -37,4 +37,5 @@ typedef struct interrupt_context {
 
 void* memset(void* ptr, int c, size_t n);
 void idt_setup();
+void idt_load();
 void idt_set_handler(uint8_t index, void* fn, uint8_t type);
\ No newline at end of file
@@ -2,97 +2,264 @@
 
 struct stivale2_struct_tag_modules* tag = NULL;
 
-// used to locally acquire a pointer to the modules tag
+// The load plans for every valid module, indexed by a hash of the module name
+exec_image_t exec_images[EXEC_MAX_IMAGES];
+int exec_image_count = 0;
+exec_image_t* exec_buckets[EXEC_HASH_BUCKETS];
+
+// ELF identification bytes and header values this kernel can run
+#define ELF_MAGIC 0x464C457F
+#define ELF_CLASS_64 2
+#define ELF_DATA_LSB 1
+#define ELF_TYPE_EXEC 2
+#define ELF_MACHINE_X86_64 0x3E
+
+// FNV-1a hash of a module name
+uint32_t exec_hash(const char* name) {
+  uint32_t hash = 2166136261u;
+
+  for (; *name != '\0'; name++) {
+    hash = (hash ^ (unsigned char) *name) * 16777619u;
+  }
+
+  return hash;
+}
+
+// Translate a program header's PF_* permissions into user VM_* flags
+int segment_flags(elf64_prg_hdr_t* segment) {
+  int flags = VM_USER;
+
+  if (segment->p_flags & PF_W) {
+    flags |= VM_WRITABLE;
+  }
+  if (segment->p_flags & PF_X) {
+    flags |= VM_EXECUTABLE;
+  }
+
+  return flags;
+}
+
+/**
+ * Validate a module's ELF image and work out how to load it.
+ * \param image The image to fill in
+ * \param module The boot module holding the ELF file
+ * \returns true if the module is an executable this kernel can run, or false if it is malformed
+ */
+bool exec_plan(exec_image_t* image, struct stivale2_module* module) {
+  uintptr_t elf_address = module->begin;
+  size_t size = module->end - module->begin;
+  elf64_hdr_t* header = (elf64_hdr_t*) elf_address;
+
+  if (size < sizeof(elf64_hdr_t) || *(uint32_t*) header->e_ident != ELF_MAGIC ||
+      header->e_ident[4] != ELF_CLASS_64 || header->e_ident[5] != ELF_DATA_LSB ||
+      header->e_type != ELF_TYPE_EXEC || header->e_machine != ELF_MACHINE_X86_64) {
+    kprint_f("exec: %s is not an x86_64 executable\n", module->string);
+    return false;
+  }
+
+  if (header->e_phentsize < sizeof(elf64_prg_hdr_t) || header->e_phoff > size ||
+      (size - header->e_phoff) / header->e_phentsize < header->e_phnum) {
+    kprint_f("exec: %s has a truncated program header table\n", module->string);
+    return false;
+  }
+
+  // Modules are loaded into one physically contiguous block, so file offsets map straight onto
+  // physical addresses
+  uintptr_t module_phys = translate_virtual_to_physcial((void*) elf_address);
+
+  image->name = module->string;
+  image->entry = header->e_entry;
+  image->segment_count = 0;
+
+  bool entry_found = false;
+  exec_segment_t* prev = NULL;
+
+  for (int i = 0; i < header->e_phnum; i++) {
+    elf64_prg_hdr_t* prg_header = (elf64_prg_hdr_t*) (elf_address + header->e_phoff + i * header->e_phentsize);
+
+    if (prg_header->p_type != PT_LOAD || prg_header->p_memsz == 0) {
+      continue;
+    }
+
+    uintptr_t vaddr = prg_header->p_vaddr;
+
+    if (image->segment_count == EXEC_MAX_SEGMENTS || prg_header->p_filesz > prg_header->p_memsz ||
+        prg_header->p_offset > size || size - prg_header->p_offset < prg_header->p_filesz ||
+        vaddr >= USER_SPACE_END - PAGE_SIZE ||
+        USER_SPACE_END - PAGE_SIZE - vaddr < prg_header->p_memsz ||
+        (prev != NULL && vaddr < prev->vaddr + prev->memsz)) {
+      kprint_f("exec: %s has a bad loadable segment\n", module->string);
+      return false;
+    }
+
+    exec_segment_t* segment = &image->segments[image->segment_count++];
+    uintptr_t end = vaddr + prg_header->p_memsz;
+
+    segment->vaddr = vaddr;
+    segment->data = elf_address + prg_header->p_offset;
+    segment->data_phys = module_phys + prg_header->p_offset;
+    segment->filesz = prg_header->p_filesz;
+    segment->memsz = prg_header->p_memsz;
+    segment->first_page = vaddr & ~(uintptr_t) (PAGE_SIZE - 1);
+    segment->npages = (end - segment->first_page + PAGE_SIZE - 1) / PAGE_SIZE;
+    segment->flags = segment_flags(prg_header);
+    segment->first_page_flags = segment->flags;
+    segment->shares_first_page = false;
+
+    // Segments may share a page at their boundary, which then needs the permissions of both
+    if (prev != NULL && segment->first_page == prev->first_page + (prev->npages - 1) * PAGE_SIZE) {
+      segment->shares_first_page = true;
+      segment->first_page_flags |= (prev->npages == 1) ? prev->first_page_flags : prev->flags;
+    }
+
+    // Whole pages of file content can be mapped onto the module when they line up with it
+    segment->shared_end = vaddr;
+    if (((vaddr | segment->data) & (PAGE_SIZE - 1)) == 0 && !segment->shares_first_page) {
+      segment->shared_end = (vaddr + segment->filesz) & ~(uintptr_t) (PAGE_SIZE - 1);
+    }
+
+    if ((segment->flags & VM_EXECUTABLE) && image->entry >= vaddr && image->entry < end) {
+      entry_found = true;
+    }
+
+    prev = segment;
+  }
+
+  if (!entry_found) {
+    kprint_f("exec: %s has no executable segment holding its entry point\n", module->string);
+    return false;
+  }
+
+  return true;
+}
+
+// used to locally acquire a pointer to the modules tag and build the executable cache
 // called before anything can be executed
 void exec_setup(struct stivale2_struct_tag_modules* param_tag) {
     tag = param_tag;
-}
 
-// find a module with the specified name and returns its starting address
-uint64_t locate_module(char* module_name) {
+    for (int i = 0; i < tag->module_count; i++) {
+      struct stivale2_module* module = &(tag->modules[i]);
+      uintptr_t page = module->begin & ~(uintptr_t) (PAGE_SIZE - 1);
+
+      // Module pages are mapped straight into programs, so give each one a permanent reference
+      // that keeps it from ever reaching the allocator
+      for (; page < module->end; page += PAGE_SIZE) {
+        pmem_pin(translate_virtual_to_physcial((void*) page));
+      }
+
+      if (exec_image_count == EXEC_MAX_IMAGES) {
+        kprint_f("exec: too many modules, ignoring %s\n", module->string);
+        continue;
+      }
+
+      exec_image_t* image = &exec_images[exec_image_count];
+
+      if (exec_plan(image, module)) {
+        uint32_t bucket = exec_hash(image->name) % EXEC_HASH_BUCKETS;
+        image->next = exec_buckets[bucket];
+        exec_buckets[bucket] = image;
+        exec_image_count++;
+      }
+    }
+}
 
-  for (int i = 0; i < tag->module_count; i++) {
-    struct stivale2_module* temp = &(tag->modules[i]);
+// find the executable with the specified name, or NULL if there is none
+exec_image_t* exec_find(const char* name) {
 
-    if (strcmp(temp->string, module_name) == 0) {
-      return temp->begin;
+  for (exec_image_t* image = exec_buckets[exec_hash(name) % EXEC_HASH_BUCKETS]; image != NULL; image = image->next) {
+    if (strcmp(image->name, name) == 0) {
+      return image;
     }
   }
 
-  return -1;
+  return NULL;
 }
 
-// executes the elf found at the given address
-void exec(uintptr_t elf_address) {
+/**
+ * Map a segment from its load plan. Pages below shared_end are mapped onto the module in place:
+ * read-only ones directly, writable ones copy-on-write. Whatever is left is mapped writable in
+ * one batch, filled from the file up to filesz and zeroed after that, including the .bss. A first
+ * page shared with the previous segment is reused.
+ * \param root The physical address of the top-level page table structure
+ * \param segment The segment to load
+ * \returns true if the segment was loaded, or false if memory for it ran out
+ */
+bool load_segment(uintptr_t root, exec_segment_t* segment) {
+  uintptr_t start = segment->vaddr;
+  uintptr_t data = segment->data;
+  uintptr_t data_phys = segment->data_phys;
+  uintptr_t file_end = segment->vaddr + segment->filesz;
+  uintptr_t map_end = segment->first_page + segment->npages * PAGE_SIZE;
 
-  // unmap the lower half of memory for the user
-  unmap_lower_half();
+  for (; start < segment->shared_end; start += PAGE_SIZE, data += PAGE_SIZE, data_phys += PAGE_SIZE) {
+    if (!vm_map_cow(root, start, data_phys, segment->flags)) {
+      return false;
+    }
+  }
 
-  elf64_hdr_t* header = (elf64_hdr_t*) elf_address;
-  elf64_prg_hdr_t* prg_header = (elf64_prg_hdr_t*) (elf_address + header->e_phoff);
+  if (start == map_end) {
+    return true;
+  }
 
-  int ph_size = header->e_phentsize;
-  int ph_num = header->e_phnum;
+  uintptr_t first_page = start & ~(uintptr_t) (PAGE_SIZE - 1);
+  uintptr_t map_start = (start == segment->vaddr && segment->shares_first_page) ? first_page + PAGE_SIZE : first_page;
 
-  uintptr_t root = get_top_table();
-  uintptr_t temp = prg_header;
+  // Map every fresh page in one batch, letting large aligned segments use huge pages. Pages stay
+  // writable until the caller applies the segment's permissions.
+  if (map_start < map_end && !vm_map_region(root, map_start, map_end - map_start, true, true, false)) {
+    return false;
+  }
 
-  for (int i = 0; i < ph_num; i++) {
-    elf64_prg_hdr_t* prg_header_curr = (elf64_prg_hdr_t*) (temp);
+  // Fresh frames hold stale data, so clear the slack before the segment on its first page
+  if (map_start == first_page) {
+    memset((void*) first_page, 0, start - first_page);
+  }
 
-    if (prg_header_curr->p_type == 1 && prg_header_curr->p_memsz > 0) {
-      bool res = vm_map(root, prg_header_curr->p_vaddr, 1, 1, 1);
+  memcpy((void*) start, (void*) data, file_end - start);
+  memset((void*) file_end, 0, map_end - file_end);
 
-      if (!res) {
-        return;
-      }
+  return true;
+}
 
-      int try = 4;
-      int temp = prg_header_curr->p_flags;
-      bool readable = false;
-      bool writable = false;
-      bool executable = false;
+// executes the program described by the given image in the current process's fresh address space
+void exec(exec_image_t* image) {
 
-      for (int i = 0; i < 3; i++) {
+  // start from no regions in case the process ran something before
+  region_clear(current_space);
 
-        if (temp - try >= 0) {
+  uintptr_t root = get_top_table();
 
-          if (try == 4) {
-            readable = true;
-          } else if (try == 2) {
-            writable = true;
-          } else {  
-            executable = true;
-          }
+  // Load every segment while its copied pages are still writable by the kernel
+  for (int i = 0; i < image->segment_count; i++) {
+    if (!load_segment(root, &image->segments[i])) {
+      kprint_f("exec: out of memory loading segment at %p\n", image->segments[i].vaddr);
+      return;
+    }
+  }
 
-          temp -= try;
-        }        
+  // Then apply each segment's permissions
+  for (int i = 0; i < image->segment_count; i++) {
+    exec_segment_t* segment = &image->segments[i];
 
-        try >>= 1;
-      }
+    vm_protect_range(root, segment->first_page, segment->npages, segment->flags);
 
-      // copy contents of elf file to virtual address
-      memcpy((void*) prg_header_curr->p_vaddr, (void*) (elf_address + prg_header_curr->p_offset), prg_header_curr->p_memsz);
-      vm_protect(root, prg_header_curr->p_vaddr, true, writable, executable);
+    if (segment->first_page_flags != segment->flags) {
+      vm_protect_range(root, segment->first_page, 1, segment->first_page_flags);
     }
-
-    // advance pointer by size of program header
-    temp += ph_size;
   }
 
   // Pick an arbitrary location and size for the user-mode stack
   uintptr_t user_stack = 0x70000000000;
   size_t user_stack_size = 8 * 0x1000;
 
-  // Map the user-mode-stack
-  for (uintptr_t p = user_stack; p < user_stack + user_stack_size; p += 0x1000) {
-    // Map a page that is user-accessible, writable, but not executable
-    vm_map(get_top_table(), p, true, true, false);
-  }
+  // Reserve the user-mode-stack as pages that are user-accessible, writable, but not executable.
+  // Pages are only backed when first touched, and the stack can grow down to USER_STACK_MAX.
+  region_reserve_stack(current_space, user_stack + user_stack_size, user_stack_size, USER_STACK_MAX, VM_USER | VM_WRITABLE);
 
   // And now jump to the entry point
   usermode_entry(USER_DATA_SELECTOR | 0x3,          // User data selector with priv=3
                 user_stack + user_stack_size - 8,   // Stack starts at the high address minus 8 bytes
                 USER_CODE_SELECTOR | 0x3,           // User code selector with priv=3
-                header->e_entry);
-}
\ No newline at end of file
+                image->entry);
+}
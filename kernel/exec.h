@@ -7,10 +7,47 @@
 #include "elf.h"
 #include "kprint.h"
 #include "gdt.h"
+#include "region.h"
 
 #include "stddef.h"
 #include "stdint.h"
 
-void exec_setup();
-uint64_t locate_module(char* module_name);
-void exec(uintptr_t elf_address);
\ No newline at end of file
+// Programs must live entirely below the kernel's half of the address space. Their segments also
+// stay out of the top page, so no syscall instruction can return to a non-canonical address.
+#define USER_SPACE_END 0x800000000000
+
+// The largest a user stack may grow to on demand
+#define USER_STACK_MAX 0x800000
+
+// Limits on the boot-time executable cache
+#define EXEC_MAX_IMAGES 16
+#define EXEC_MAX_SEGMENTS 8
+#define EXEC_HASH_BUCKETS 32
+
+// One PT_LOAD segment's part of a load plan, with every address and permission worked out
+typedef struct exec_segment {
+  uintptr_t vaddr;        // Where the segment starts in memory
+  uintptr_t data;         // Where its file contents start in the module
+  uintptr_t data_phys;    // The physical address of data
+  size_t filesz;          // Bytes to take from the file
+  size_t memsz;           // Bytes of memory, the rest zeroed
+  uintptr_t first_page;   // The page-aligned range the segment touches
+  size_t npages;
+  uintptr_t shared_end;   // Pages below this are mapped onto the module in place
+  bool shares_first_page; // The first page also belongs to the previous segment
+  int flags;              // VM_* protection for the segment's pages
+  int first_page_flags;   // VM_* protection for the first page, merged with any shared segment
+} exec_segment_t;
+
+// A validated executable from a boot module, ready to be loaded without looking at the ELF again
+typedef struct exec_image {
+  char* name;
+  uintptr_t entry;
+  exec_segment_t segments[EXEC_MAX_SEGMENTS];
+  int segment_count;
+  struct exec_image* next;  // The next image in the same hash bucket
+} exec_image_t;
+
+void exec_setup(struct stivale2_struct_tag_modules* param_tag);
+exec_image_t* exec_find(const char* name);
+void exec(exec_image_t* image);
\ No newline at end of file
@@ -5,13 +5,18 @@
 #include <stdbool.h>
 #include <string.h>
 
+#include "cpu.h"
+
 #define MAX_GDT_SIZE 256
+#define INTERRUPT_STACK_SIZE 0x8000
 
-// Reserve space for interrupt handlers to use as a stack
-uint8_t interrupt_stack[0x8000];
+// Reserve space for interrupt handlers to use as a stack until a process gives each CPU its own
+uint8_t interrupt_stacks[MAX_CPUS][INTERRUPT_STACK_SIZE];
 
-// Reserve space for a GDT that we'll fill in below
-uint8_t gdt[MAX_GDT_SIZE];
+// Reserve space for each CPU's GDT, filled in below. Every CPU needs its own GDT because the TSS
+// descriptor points at that CPU's TSS.
+uint8_t gdts[MAX_CPUS][MAX_GDT_SIZE];
+uint8_t* gdt = NULL;
 size_t gdt_size = 0;
 
 // Struct definition for a segment descriptor
@@ -73,8 +78,8 @@ typedef struct tss {
   uint16_t iomap;
 } __attribute__((packed)) tss_t;
 
-// Declare a task state segment
-tss_t tss;
+// Declare a task state segment for each CPU
+tss_t tsses[MAX_CPUS];
 
 // Struct definition for a system descriptor
 typedef struct sys_descriptor {
@@ -116,19 +121,23 @@ typedef struct gdt_record {
 } __attribute__((packed)) gdt_record_t;
 
 void gdt_setup() {
-  // Zero out the gdt
-  memset(gdt, 0, sizeof(gdt));
+  uint32_t cpu = cpu_id();
+  tss_t* tss = &tsses[cpu];
+
+  // Zero out this CPU's gdt
+  gdt = gdts[cpu];
+  memset(gdt, 0, MAX_GDT_SIZE);
 
   // Create the kernel code and data descriptors
   gdt_code_descriptor(KERNEL_CODE_SELECTOR, false);
   gdt_data_descriptor(KERNEL_DATA_SELECTOR, false);
 
-  // Create the user code and data descriptors
-  gdt_code_descriptor(USER_CODE_SELECTOR, true);
+  // Create the user data and code descriptors
   gdt_data_descriptor(USER_DATA_SELECTOR, true);
+  gdt_code_descriptor(USER_CODE_SELECTOR, true);
 
   // NEW: create a TSS descriptor
-  gdt_tss_descriptor(TSS_SELECTOR, &tss);
+  gdt_tss_descriptor(TSS_SELECTOR, tss);
 
   // Load the GDT
   gdt_record_t record = {
@@ -138,11 +147,22 @@ void gdt_setup() {
   __asm__("lgdt %0" :: "m"(record));
 
   // Zero out the TSS
-  memset(&tss, 0, sizeof(tss));
+  memset(tss, 0, sizeof(tss_t));
 
-  // Interrupts delivered while in user mode should use this stack pointer
-  tss.rsp0 = (uintptr_t)interrupt_stack + sizeof(interrupt_stack) - 8;
+  // Interrupts and system calls from user mode should use this stack pointer
+  gdt_set_kernel_stack((uintptr_t)interrupt_stacks[cpu] + INTERRUPT_STACK_SIZE - 8);
 
   // Load the TSS
   __asm__("ltr %%ax" :: "a"(TSS_SELECTOR));
 }
+
+// Switch the stack interrupts and system calls from user mode arrive on, e.g. to the running
+// process's kernel stack
+void gdt_set_kernel_stack(uintptr_t stack_top) {
+  cpu_t* cpu = this_cpu();
+
+  tsses[cpu->id].rsp0 = stack_top;
+
+  // The syscall instruction does not switch stacks; syscall_fast_entry loads this one itself
+  cpu->kernel_stack_top = stack_top;
+}
@@ -5,9 +5,12 @@
 // Define the offsets into the GDT where we'll place important descriptors
 #define KERNEL_CODE_SELECTOR 0x08
 #define KERNEL_DATA_SELECTOR 0x10
-#define USER_CODE_SELECTOR 0x18
-#define USER_DATA_SELECTOR 0x20
+// sysret loads the user data selector from the slot after the kernel data selector and the user
+// code selector from the one after that, so they must stay in this order
+#define USER_DATA_SELECTOR 0x18
+#define USER_CODE_SELECTOR 0x20
 #define TSS_SELECTOR 0x28
 
 // Set up and load the GDT
 void gdt_setup();
+void gdt_set_kernel_stack(uintptr_t stack_top);
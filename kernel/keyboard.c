@@ -4,6 +4,11 @@
 #include "port.h"
 #include "pic.h"
 #include "kprint.h"
+#include "mem.h"
+#include "sched.h"
+#include "cpu.h"
+#include "lock.h"
+#include "wait.h"
 
 
 #define circ_buffer_len 10
@@ -45,6 +50,9 @@ char kbd_US [128] =
 };
 
 
+// Processes waiting in kgetc() for a key. Its lock protects the buffer, which the interrupt
+// handler fills on one CPU while kgetc() may be emptying it on another.
+wait_queue_t keyboard_waiters;
 int circ_buffer[circ_buffer_len];     // N elements circular buffer
 int end = 0;    // write index
 int start = 0;  // read index
@@ -52,12 +60,18 @@ volatile size_t buffer_count = 0; // current capacity
 int leftShiftIsPressed = 0;
 int rightShiftIsPressed = 0;
 
+// Called with the keyboard_waiters lock held. Drops the key if the buffer is full.
 void write(int item) {
+  if (buffer_count == circ_buffer_len) {
+    return;
+  }
+
   circ_buffer[end++] = item;
   buffer_count++;
   end %= circ_buffer_len;
 }
 
+// Called with the keyboard_waiters lock held and the buffer not empty
 int read() {
   int item = circ_buffer[start++];
   start %= circ_buffer_len;
@@ -80,6 +94,12 @@ int isSpecial(int key) {
 __attribute__((interrupt))
 void keypress_handler(interrupt_context_t* ctx) {
 
+  bool from_user = (ctx->cs & 3) == 3;
+
+  if (from_user) {
+    swapgs();
+  }
+
   uint8_t val = inb(0x60);
 
   if (val == 0x2A) {
@@ -95,10 +115,17 @@ void keypress_handler(interrupt_context_t* ctx) {
   }
 
   if (isNumeric(val) || isAlpha(val) || isSpecial(val)) {
+    spin_lock(&keyboard_waiters.lock);
     write(val);
+    wait_queue_wake_all_locked(&keyboard_waiters);
+    spin_unlock(&keyboard_waiters.lock);
   }
 
   outb(PIC1_COMMAND, PIC_EOI);
+
+  if (from_user) {
+    swapgs();
+  }
 }
 
 /**
@@ -109,10 +136,17 @@ void keypress_handler(interrupt_context_t* ctx) {
  */
 char kgetc() {
 
-  // spin until there is something to read
-  while (buffer_count == 0) {}
+  // sleep until the interrupt handler puts something in the buffer
+  uint64_t flags = wait_queue_lock(&keyboard_waiters);
+
+  while (buffer_count == 0) {
+    wait_queue_sleep(&keyboard_waiters, flags);
+    flags = wait_queue_lock(&keyboard_waiters);
+  }
 
   int key = read();
+  wait_queue_unlock(&keyboard_waiters, flags);
+
   char ch = kbd_US[key];
 
   // check whether to upper case the letter
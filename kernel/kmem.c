@@ -0,0 +1,490 @@
+#include "kmem.h"
+#include "kprint.h"
+
+#define KMEM_CACHE_LINE 64
+
+// Slabs hold at least this many objects unless that would make them larger than the max order
+#define KMEM_MIN_OBJECTS 8
+#define KMEM_MAX_SLAB_ORDER 3
+
+// kmalloc serves 16 B to 2 KiB from caches and anything larger from whole pages
+#define KMALLOC_MIN_SHIFT 4
+#define KMALLOC_MAX_SHIFT 11
+#define KMALLOC_CACHES (KMALLOC_MAX_SHIFT - KMALLOC_MIN_SHIFT + 1)
+
+// Tags at the start of every page-aligned block handed out by this allocator
+#define KMEM_SLAB_MAGIC 0x42414c53
+#define KMEM_LARGE_MAGIC 0x4547524c
+
+// The header at the start of every slab; objects follow it
+typedef struct kmem_slab {
+  uint32_t magic;
+  struct kmem_slab* next;
+  struct kmem_slab* prev;
+  kmem_cache_t* cache;
+  void* free;               // singly-linked list of free objects in this slab
+  size_t in_use;
+} kmem_slab_t;
+
+// The header at the start of a large kmalloc allocation
+typedef struct kmem_large {
+  uint32_t magic;
+  int order;
+} kmem_large_t;
+
+// The cache that kmem_cache_t structures themselves come from
+kmem_cache_t cache_cache;
+
+kmem_cache_t kmalloc_caches[KMALLOC_CACHES];
+const char* kmalloc_names[KMALLOC_CACHES] = {
+  "kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+  "kmalloc-256", "kmalloc-512", "kmalloc-1024", "kmalloc-2048"
+};
+
+kmem_cache_t* all_caches = NULL;
+spinlock_t all_caches_lock;
+
+// Set up the fields of a cache and add it to the list of all caches
+void kmem_cache_init(kmem_cache_t* cache, const char* name, size_t size, size_t align, int max_order) {
+
+  memset(cache, 0, sizeof(kmem_cache_t));
+
+  // Objects must be able to hold the free list link
+  if (size < sizeof(void*)) {
+    size = sizeof(void*);
+  }
+
+  // By default align to the object's size rounded to a power of two, at most a cache line, so
+  // small objects pack densely and no object straddles more cache lines than it must
+  if (align == 0) {
+    align = sizeof(void*);
+    while (align < size && align < KMEM_CACHE_LINE) {
+      align <<= 1;
+    }
+  }
+
+  cache->name = name;
+  cache->object_size = (size + align - 1) & ~(align - 1);
+  cache->object_offset = (sizeof(kmem_slab_t) + align - 1) & ~(align - 1);
+
+  // Pick the smallest slab that holds enough objects
+  cache->slab_order = 0;
+  while (cache->slab_order < max_order &&
+         (((size_t) PAGE_SIZE << cache->slab_order) - cache->object_offset) / cache->object_size < KMEM_MIN_OBJECTS) {
+    cache->slab_order++;
+  }
+
+  cache->objects_per_slab = (((size_t) PAGE_SIZE << cache->slab_order) - cache->object_offset) / cache->object_size;
+
+  uint64_t flags = spin_lock_irqsave(&all_caches_lock);
+  cache->next = all_caches;
+  all_caches = cache;
+  spin_unlock_irqrestore(&all_caches_lock, flags);
+}
+
+void kmem_init() {
+  kmem_cache_init(&cache_cache, "kmem_cache", sizeof(kmem_cache_t), KMEM_CACHE_LINE, KMEM_MAX_SLAB_ORDER);
+
+  // kmalloc slabs are always a single page so kfree can find the slab from any object
+  for (int i = 0; i < KMALLOC_CACHES; i++) {
+    kmem_cache_init(&kmalloc_caches[i], kmalloc_names[i], (size_t) 1 << (KMALLOC_MIN_SHIFT + i), 0, 0);
+  }
+}
+
+kmem_cache_t* kmem_cache_create(const char* name, size_t size, size_t align) {
+
+  // Objects larger than the biggest slab could never be allocated
+  if (size > ((size_t) PAGE_SIZE << KMEM_MAX_SLAB_ORDER) / 2) {
+    return NULL;
+  }
+
+  kmem_cache_t* cache = kmem_cache_alloc(&cache_cache);
+
+  if (cache != NULL) {
+    kmem_cache_init(cache, name, size, align, KMEM_MAX_SLAB_ORDER);
+  }
+
+  return cache;
+}
+
+// The list a slab belongs on given how many of its objects are in use
+kmem_slab_t** slab_list_for(kmem_cache_t* cache, kmem_slab_t* slab) {
+  if (slab->in_use == 0) {
+    return &cache->empty;
+  } else if (slab->free == NULL) {
+    return &cache->full;
+  }
+
+  return &cache->partial;
+}
+
+void slab_list_push(kmem_slab_t** list, kmem_slab_t* slab) {
+  slab->prev = NULL;
+  slab->next = *list;
+
+  if (*list != NULL) {
+    (*list)->prev = slab;
+  }
+
+  *list = slab;
+}
+
+void slab_list_remove(kmem_slab_t** list, kmem_slab_t* slab) {
+  if (slab->prev != NULL) {
+    slab->prev->next = slab->next;
+  } else {
+    *list = slab->next;
+  }
+
+  if (slab->next != NULL) {
+    slab->next->prev = slab->prev;
+  }
+}
+
+// Allocate a new slab and thread all of its objects onto its free list. Called with the cache lock held.
+kmem_slab_t* slab_create(kmem_cache_t* cache) {
+  uintptr_t block = pmem_alloc_pages(cache->slab_order);
+
+  if (block == 0) {
+    return NULL;
+  }
+
+  kmem_slab_t* slab = (kmem_slab_t*) ptov((void*) block);
+  slab->magic = KMEM_SLAB_MAGIC;
+  slab->cache = cache;
+  slab->in_use = 0;
+  slab->free = NULL;
+
+  // Build the free list back to front so objects are handed out in address order
+  for (size_t i = cache->objects_per_slab; i > 0; i--) {
+    void** object = (void**) ((uintptr_t) slab + cache->object_offset + (i - 1) * cache->object_size);
+    *object = slab->free;
+    slab->free = object;
+  }
+
+  cache->slabs_created++;
+
+  return slab;
+}
+
+// Take one object from the cache's slabs. Called with the cache lock held.
+void* slab_alloc_object(kmem_cache_t* cache) {
+  kmem_slab_t* slab = (cache->partial != NULL) ? cache->partial : cache->empty;
+
+  if (slab == NULL) {
+    slab = slab_create(cache);
+
+    if (slab == NULL) {
+      return NULL;
+    }
+
+    slab_list_push(&cache->empty, slab);
+  }
+
+  slab_list_remove(slab_list_for(cache, slab), slab);
+
+  void** object = slab->free;
+  slab->free = *object;
+  slab->in_use++;
+
+  slab_list_push(slab_list_for(cache, slab), slab);
+
+  return object;
+}
+
+// Return one object to its slab, releasing the slab if it is empty and another empty slab is
+// already cached. Called with the cache lock held.
+void slab_free_object(kmem_cache_t* cache, void* object) {
+  uintptr_t slab_bytes = (uintptr_t) PAGE_SIZE << cache->slab_order;
+  kmem_slab_t* slab = (kmem_slab_t*) ((uintptr_t) object & ~(slab_bytes - 1));
+
+  slab_list_remove(slab_list_for(cache, slab), slab);
+
+  *(void**) object = slab->free;
+  slab->free = object;
+  slab->in_use--;
+
+  if (slab->in_use == 0 && cache->empty != NULL) {
+    pmem_free_pages((uintptr_t) slab - get_hhdm_base(), cache->slab_order);
+    cache->slabs_released++;
+    return;
+  }
+
+  slab_list_push(slab_list_for(cache, slab), slab);
+}
+
+/**
+ * Allocate an object from a cache. The current CPU's cache is tried first, and refilled from the
+ * slabs a batch at a time when it is empty.
+ * \returns a pointer to the object, or NULL if there was no memory for it
+ */
+void* kmem_cache_alloc(kmem_cache_t* cache) {
+  uint64_t flags = irq_save();
+  kmem_cpu_cache_t* cpu = &cache->cpu[cpu_id()];
+
+  cpu->allocs++;
+
+  if (cpu->count > 0) {
+    cpu->hits++;
+  } else {
+    spin_lock(&cache->lock);
+    while (cpu->count < KMEM_CPU_BATCH) {
+      void* object = slab_alloc_object(cache);
+
+      if (object == NULL) {
+        break;
+      }
+
+      cpu->objects[cpu->count++] = object;
+    }
+    spin_unlock(&cache->lock);
+  }
+
+  void* object = (cpu->count > 0) ? cpu->objects[--cpu->count] : NULL;
+
+  irq_restore(flags);
+
+  return object;
+}
+
+/**
+ * Free an object back to the cache it was allocated from. Objects go to the current CPU's cache,
+ * which spills a batch back to the slabs when it is full.
+ */
+void kmem_cache_free(kmem_cache_t* cache, void* object) {
+  if (object == NULL) {
+    return;
+  }
+
+  uint64_t flags = irq_save();
+  kmem_cpu_cache_t* cpu = &cache->cpu[cpu_id()];
+
+  cpu->frees++;
+
+  if (cpu->count == KMEM_CPU_CACHE_SIZE) {
+    spin_lock(&cache->lock);
+    for (size_t i = 0; i < KMEM_CPU_BATCH; i++) {
+      slab_free_object(cache, cpu->objects[--cpu->count]);
+    }
+    spin_unlock(&cache->lock);
+  }
+
+  cpu->objects[cpu->count++] = object;
+
+  irq_restore(flags);
+}
+
+void kmem_cache_get_stats(kmem_cache_t* cache, kmem_cache_stats_t* stats) {
+  memset(stats, 0, sizeof(kmem_cache_stats_t));
+
+  for (size_t i = 0; i < MAX_CPUS; i++) {
+    stats->allocs += cache->cpu[i].allocs;
+    stats->frees += cache->cpu[i].frees;
+    stats->cpu_hits += cache->cpu[i].hits;
+  }
+
+  stats->slabs_created = cache->slabs_created;
+  stats->slabs_released = cache->slabs_released;
+}
+
+/**
+ * Allocate memory for the kernel. Sizes up to 2 KiB come from the power-of-two caches; larger
+ * sizes get their own naturally-aligned block of pages.
+ * \returns a pointer to at least size bytes, or NULL on error
+ */
+void* kmalloc(size_t size) {
+  if (size == 0) {
+    return NULL;
+  }
+
+  if (size <= ((size_t) 1 << KMALLOC_MAX_SHIFT)) {
+    int index = 0;
+    while (((size_t) 1 << (KMALLOC_MIN_SHIFT + index)) < size) {
+      index++;
+    }
+
+    return kmem_cache_alloc(&kmalloc_caches[index]);
+  }
+
+  // Large allocations start with a header recording the block order, padded to a cache line
+  size_t pages = (size + KMEM_CACHE_LINE + PAGE_SIZE - 1) / PAGE_SIZE;
+  int order = 0;
+  while (((size_t) 1 << order) < pages) {
+    order++;
+  }
+
+  uintptr_t block = pmem_alloc_pages(order);
+
+  if (block == 0) {
+    return NULL;
+  }
+
+  kmem_large_t* header = (kmem_large_t*) ptov((void*) block);
+  header->magic = KMEM_LARGE_MAGIC;
+  header->order = order;
+
+  return (void*) ((uintptr_t) header + KMEM_CACHE_LINE);
+}
+
+// Free memory returned by kmalloc
+void kfree(void* ptr) {
+  if (ptr == NULL) {
+    return;
+  }
+
+  // kmalloc slabs are a single page and large blocks start with their header, so either way the
+  // tag is at the start of the pointer's page
+  uintptr_t base = (uintptr_t) ptr & ~(uintptr_t) (PAGE_SIZE - 1);
+
+  if (((kmem_large_t*) base)->magic == KMEM_LARGE_MAGIC) {
+    pmem_free_pages(base - get_hhdm_base(), ((kmem_large_t*) base)->order);
+    return;
+  }
+
+  kmem_slab_t* slab = (kmem_slab_t*) base;
+  kmem_cache_free(slab->cache, ptr);
+}
+
+void kmem_print_stats() {
+  kprint_f("cache            size  allocs  frees  cpu hits  slabs  released\n");
+
+  for (kmem_cache_t* cache = all_caches; cache != NULL; cache = cache->next) {
+    kmem_cache_stats_t stats;
+    kmem_cache_get_stats(cache, &stats);
+
+    kprint_f("%s  %d  %d  %d  %d  %d  %d\n", cache->name, cache->object_size, stats.allocs,
+             stats.frees, stats.cpu_hits, stats.slabs_created, stats.slabs_released);
+  }
+}
+
+// Objects the self-test allocates from its cache: enough to fill several slabs, so slabs are
+// created and released, plus a per-CPU cache's worth more
+#define KMEM_TEST_OBJECT_SIZE 200
+#define KMEM_TEST_SLABS 4
+
+// Report a failed self-test check
+bool kmem_test_fail(const char* what) {
+  kprint_f("kmem self-test failed: %s\n", what);
+  return false;
+}
+
+// Check that every byte of a block still holds the pattern written to it
+bool kmem_test_pattern(const void* ptr, size_t size, uint8_t pattern) {
+  const uint8_t* bytes = ptr;
+  for (size_t i = 0; i < size; i++) {
+    if (bytes[i] != pattern) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool kmem_self_test() {
+  kmem_cache_t* cache = kmem_cache_create("kmem-test", KMEM_TEST_OBJECT_SIZE, 0);
+
+  if (cache == NULL) {
+    return kmem_test_fail("could not create a cache");
+  }
+
+  size_t count = cache->objects_per_slab * KMEM_TEST_SLABS + KMEM_CPU_CACHE_SIZE;
+
+  void** objects = kmalloc(count * sizeof(void*));
+
+  if (objects == NULL) {
+    return kmem_test_fail("could not allocate the object array");
+  }
+
+  // Every object must be distinct and usable in full, so fill each one and check them all once
+  // they are all allocated
+  for (size_t i = 0; i < count; i++) {
+    objects[i] = kmem_cache_alloc(cache);
+
+    if (objects[i] == NULL) {
+      return kmem_test_fail("cache allocation returned NULL");
+    }
+
+    memset(objects[i], (int) i, KMEM_TEST_OBJECT_SIZE);
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    if (!kmem_test_pattern(objects[i], KMEM_TEST_OBJECT_SIZE, (uint8_t) i)) {
+      return kmem_test_fail("cache objects overlap");
+    }
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    kmem_cache_free(cache, objects[i]);
+  }
+
+  kmem_cache_stats_t stats;
+  kmem_cache_get_stats(cache, &stats);
+
+  if (stats.allocs != count || stats.frees != count) {
+    return kmem_test_fail("cache counters do not match the allocations made");
+  }
+  if (stats.slabs_created < KMEM_TEST_SLABS) {
+    return kmem_test_fail("objects did not spread over several slabs");
+  }
+  if (stats.slabs_released == 0) {
+    return kmem_test_fail("no empty slab was released");
+  }
+
+  kfree(objects);
+
+  // Small sizes round up to a power-of-two cache, and neighbours must not overlap
+  size_t small_sizes[] = {1, 16, 17, 1000, (size_t) 1 << KMALLOC_MAX_SHIFT};
+
+  for (size_t i = 0; i < sizeof(small_sizes) / sizeof(small_sizes[0]); i++) {
+    size_t size = small_sizes[i];
+    void* first = kmalloc(size);
+    void* second = kmalloc(size);
+
+    if (first == NULL || second == NULL) {
+      return kmem_test_fail("small kmalloc returned NULL");
+    }
+
+    memset(first, 0x5a, size);
+    memset(second, 0xa5, size);
+
+    if (!kmem_test_pattern(first, size, 0x5a) || !kmem_test_pattern(second, size, 0xa5)) {
+      return kmem_test_fail("small kmalloc blocks overlap");
+    }
+
+    kfree(first);
+    kfree(second);
+  }
+
+  // Large sizes get their own blocks of pages, which kfree must give back in full
+  size_t large_sizes[] = {((size_t) 1 << KMALLOC_MAX_SHIFT) + 1, PAGE_SIZE * 3, PAGE_SIZE * 16};
+
+  for (size_t i = 0; i < sizeof(large_sizes) / sizeof(large_sizes[0]); i++) {
+    size_t size = large_sizes[i];
+    pmem_usage_t before;
+    pmem_usage_t after;
+
+    pmem_get_usage(&before);
+    void* block = kmalloc(size);
+
+    if (block == NULL) {
+      return kmem_test_fail("large kmalloc returned NULL");
+    }
+    if (((uintptr_t) block & (PAGE_SIZE - 1)) != KMEM_CACHE_LINE) {
+      return kmem_test_fail("large kmalloc block does not follow its header");
+    }
+
+    memset(block, 0x3c, size);
+    if (!kmem_test_pattern(block, size, 0x3c)) {
+      return kmem_test_fail("large kmalloc block is not usable in full");
+    }
+
+    kfree(block);
+    pmem_get_usage(&after);
+
+    if (after.free_pages != before.free_pages) {
+      return kmem_test_fail("kfree did not return a large block's pages");
+    }
+  }
+
+  return true;
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include "mem.h"
+#include "cpu.h"
+#include "lock.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Objects in each CPU's private cache, and how many move to or from the slabs at once
+#define KMEM_CPU_CACHE_SIZE 8
+#define KMEM_CPU_BATCH 4
+
+// Recently freed objects that one CPU can reuse without taking the cache lock
+typedef struct kmem_cpu_cache {
+  void* objects[KMEM_CPU_CACHE_SIZE];
+  size_t count;
+  uint64_t allocs;
+  uint64_t frees;
+  uint64_t hits;
+} kmem_cpu_cache_t;
+
+struct kmem_slab;
+
+// A cache of equally-sized objects carved out of slabs of physical pages
+typedef struct kmem_cache {
+  const char* name;
+  size_t object_size;       // size of each object, rounded up to its alignment
+  size_t object_offset;     // offset of the first object from the start of a slab
+  size_t objects_per_slab;
+  int slab_order;           // each slab is 2^slab_order pages
+
+  spinlock_t lock;          // protects the slab lists and slab counters
+  struct kmem_slab* partial;
+  struct kmem_slab* full;
+  struct kmem_slab* empty;
+  uint64_t slabs_created;
+  uint64_t slabs_released;
+
+  kmem_cpu_cache_t cpu[MAX_CPUS];
+  struct kmem_cache* next;  // every cache, for statistics
+} kmem_cache_t;
+
+// Statistics for one cache, summed over all CPUs
+typedef struct kmem_cache_stats {
+  uint64_t allocs;
+  uint64_t frees;
+  uint64_t cpu_hits;        // allocations served from a per-CPU cache
+  uint64_t slabs_created;
+  uint64_t slabs_released;
+} kmem_cache_stats_t;
+
+void kmem_init();
+
+/**
+ * Create a cache of fixed-size objects.
+ * \param name A name for the cache, shown in statistics
+ * \param size The size of each object in bytes
+ * \param align The alignment of each object, or 0 to align to the object's size up to a cache line
+ * \returns the new cache, or NULL if there was no memory for it
+ */
+kmem_cache_t* kmem_cache_create(const char* name, size_t size, size_t align);
+
+void* kmem_cache_alloc(kmem_cache_t* cache);
+void kmem_cache_free(kmem_cache_t* cache, void* object);
+void kmem_cache_get_stats(kmem_cache_t* cache, kmem_cache_stats_t* stats);
+
+// General-purpose allocation from power-of-two caches, or whole pages for large sizes
+void* kmalloc(size_t size);
+void kfree(void* ptr);
+
+// Print the statistics of every cache to the terminal
+void kmem_print_stats();
+
+/**
+ * Exercise a cache across several slabs and kmalloc's small and large paths, checking the memory
+ * handed out and the counters kept. Leaves its cache behind, so its counters show in statistics.
+ * \returns true if every check passed; failures are printed to the terminal
+ */
+bool kmem_self_test();
@@ -1,8 +1,12 @@
 #include "kprint.h"
+#include "lock.h"
 
 #define DECIMAL 10
 #define HEXADECIMAL 16
 
+// Keeps messages from different CPUs from interleaving on the terminal
+spinlock_t kprint_lock;
+
 // Return the number of digits of a value with respect to a base
 int digit_len(uint64_t num, int base) {
   int i = 0;
@@ -89,6 +93,8 @@ void kprint_f(const char* format, ...) {
 
   va_start(ap, format);
 
+  uint64_t flags = spin_lock_irqsave(&kprint_lock);
+
   while (*pos != '\0') {
 
     if (*pos == '%') {
@@ -123,5 +129,7 @@ void kprint_f(const char* format, ...) {
     pos++;
   }
 
+  spin_unlock_irqrestore(&kprint_lock, flags);
+
   va_end(ap);
 }
\ No newline at end of file
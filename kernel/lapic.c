@@ -0,0 +1,108 @@
+#include "lapic.h"
+#include "cpu.h"
+#include "mem.h"
+#include "timer.h"
+#include "exception.h"
+#include "sched.h"
+#include "vdso.h"
+
+// The APIC base MSR; the register block is at its page-aligned address
+#define MSR_APIC_BASE 0x1B
+
+// Local APIC register offsets
+#define LAPIC_ID 0x20
+#define LAPIC_EOI 0xB0
+#define LAPIC_SVR 0xF0
+#define LAPIC_LVT_TIMER 0x320
+#define LAPIC_TIMER_INITIAL 0x380
+#define LAPIC_TIMER_CURRENT 0x390
+#define LAPIC_TIMER_DIVIDE 0x3E0
+
+#define LAPIC_SVR_ENABLE 0x100
+#define LAPIC_LVT_MASKED (1 << 16)
+#define LAPIC_LVT_PERIODIC (1 << 17)
+#define LAPIC_DIVIDE_16 0x3
+
+// PIT ticks to measure the local APIC timer over
+#define LAPIC_CALIBRATE_TICKS 10
+
+// Local APIC timer counts per second, divided by 16
+uint64_t lapic_timer_frequency = 0;
+
+// The register block, reached through the higher-half direct map, which covers the first 4 GiB
+volatile uint32_t* lapic_registers() {
+  return (volatile uint32_t*) ptov((void*) (rdmsr(MSR_APIC_BASE) & ~(uintptr_t) 0xFFF));
+}
+
+uint32_t lapic_read(uint32_t reg) {
+  return lapic_registers()[reg / 4];
+}
+
+void lapic_write(uint32_t reg, uint32_t value) {
+  lapic_registers()[reg / 4] = value;
+}
+
+__attribute__((interrupt))
+void lapic_spurious_handler(interrupt_context_t* ctx) {
+  // Spurious interrupts need no end-of-interrupt
+}
+
+__attribute__((interrupt))
+void lapic_timer_handler(interrupt_context_t* ctx) {
+  bool from_user = (ctx->cs & 3) == 3;
+
+  if (from_user) {
+    swapgs();
+  }
+
+  lapic_eoi();
+  vdso_tick();
+  sched_tick(from_user);
+
+  if (from_user) {
+    swapgs();
+  }
+}
+
+void lapic_init() {
+  idt_set_handler(LAPIC_SPURIOUS_INTERRUPT, lapic_spurious_handler, IDT_TYPE_INTERRUPT);
+  idt_set_handler(LAPIC_TIMER_INTERRUPT, lapic_timer_handler, IDT_TYPE_INTERRUPT);
+
+  lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | LAPIC_SPURIOUS_INTERRUPT);
+}
+
+void lapic_eoi() {
+  lapic_write(LAPIC_EOI, 0);
+}
+
+uint32_t lapic_id() {
+  return lapic_read(LAPIC_ID) >> 24;
+}
+
+void lapic_timer_calibrate() {
+  lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_DIVIDE_16);
+  lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+
+  // Start on a tick boundary, then count down for a whole number of PIT ticks
+  uint64_t start = timer_ticks;
+  while (timer_ticks == start) {
+    __asm__ volatile("pause");
+  }
+
+  lapic_write(LAPIC_TIMER_INITIAL, 0xFFFFFFFF);
+  start = timer_ticks;
+  while (timer_ticks - start < LAPIC_CALIBRATE_TICKS) {
+    __asm__ volatile("pause");
+  }
+
+  uint32_t elapsed = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_CURRENT);
+  lapic_write(LAPIC_TIMER_INITIAL, 0);
+
+  lapic_timer_frequency = (uint64_t) elapsed * TIMER_HZ / LAPIC_CALIBRATE_TICKS;
+}
+
+void lapic_timer_start(uint32_t hz) {
+  lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_DIVIDE_16);
+  lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_INTERRUPT | LAPIC_LVT_PERIODIC);
+  lapic_write(LAPIC_TIMER_INITIAL, lapic_timer_frequency / hz);
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdint.h>
+
+// Interrupt vectors for the local APIC timer and spurious interrupts
+#define LAPIC_TIMER_INTERRUPT 0x30
+#define LAPIC_SPURIOUS_INTERRUPT 0xFF
+
+// Enable the calling CPU's local APIC
+void lapic_init();
+
+// Signal the end of an interrupt delivered through the local APIC
+void lapic_eoi();
+
+// Read the calling CPU's local APIC ID
+uint32_t lapic_id();
+
+/**
+ * Measure the local APIC timer against the PIT tick. Runs once on the bootstrap processor after
+ * timer_setup(), with interrupts enabled.
+ */
+void lapic_timer_calibrate();
+
+/**
+ * Start the calling CPU's local APIC timer, delivering ticks to the scheduler.
+ * \param hz The number of interrupts per second
+ */
+void lapic_timer_start(uint32_t hz);
@@ -0,0 +1,34 @@
+#include "lock.h"
+#include "kprint.h"
+#include "wait.h"
+
+// The kernel's global locks, defined next to the data they protect
+extern spinlock_t pmem_lock;
+extern spinlock_t zero_pool_lock;
+extern spinlock_t all_caches_lock;
+extern spinlock_t kprint_lock;
+extern spinlock_t proc_table_lock;
+extern spinlock_t sched_spinlock;
+extern wait_queue_t keyboard_waiters;
+
+void lock_print_stats(const char* name, spinlock_t* lock) {
+#if LOCK_STATS
+  // Copy the counters first, since printing takes kprint_lock, which may be the lock itself
+  lock_stats_t stats = lock->stats;
+
+  kprint_f("%s: %d acquires, %d contended, %d cycles max hold\n", name, stats.acquires,
+           stats.contended, stats.max_hold_cycles);
+#else
+  kprint_f("%s: no counters, LOCK_STATS is disabled\n", name);
+#endif
+}
+
+void lock_report() {
+  lock_print_stats("pmem", &pmem_lock);
+  lock_print_stats("zero pool", &zero_pool_lock);
+  lock_print_stats("kmem caches", &all_caches_lock);
+  lock_print_stats("kprint", &kprint_lock);
+  lock_print_stats("process table", &proc_table_lock);
+  lock_print_stats("scheduler", &sched_spinlock);
+  lock_print_stats("keyboard", &keyboard_waiters.lock);
+}
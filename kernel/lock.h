@@ -0,0 +1,178 @@
+#pragma once
+
+#include "util.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Set to 1 to have every lock count its acquisitions, how many had to wait, and the longest it
+// was held. Costs two rdtsc per acquisition, so it is off by default.
+#define LOCK_STATS 0
+
+// Counters kept by each lock when LOCK_STATS is enabled. Only updated by the lock's holder.
+typedef struct lock_stats {
+  uint64_t acquires;
+  uint64_t contended;       // Acquisitions that found the lock held and had to wait
+  uint64_t max_hold_cycles; // The longest the lock was held, in TSC cycles
+  uint64_t hold_start;      // When the current holder took the lock
+} lock_stats_t;
+
+// A ticket spinlock. Each CPU takes the next ticket and waits for it to be served, so waiters get
+// the lock in the order they asked for it and none can starve. Zero-initialized means unlocked.
+typedef struct spinlock {
+  volatile uint32_t next;   // The next ticket to hand out
+  volatile uint32_t owner;  // The ticket currently holding the lock
+#if LOCK_STATS
+  lock_stats_t stats;
+#endif
+} spinlock_t;
+
+// A reader-writer lock. Readers and writers queue on the ticket lock in arrival order, so a
+// waiting writer holds back later readers instead of starving behind them; readers only hold the
+// ticket lock long enough to register themselves.
+typedef struct rwlock {
+  spinlock_t writer;
+  volatile uint32_t readers;
+} rwlock_t;
+
+static inline void spin_lock(spinlock_t* lock) {
+  uint32_t ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_RELAXED);
+  bool contended = false;
+
+  while (__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) != ticket) {
+    contended = true;
+    __asm__ volatile("pause");
+  }
+
+#if LOCK_STATS
+  lock->stats.acquires++;
+  lock->stats.contended += contended;
+  lock->stats.hold_start = rdtsc();
+#else
+  (void) contended;
+#endif
+}
+
+/**
+ * Take a spinlock only if it is free.
+ * \returns true if the lock was taken
+ */
+static inline bool spin_trylock(spinlock_t* lock) {
+  uint32_t owner = __atomic_load_n(&lock->owner, __ATOMIC_RELAXED);
+  uint32_t ticket = owner;
+
+  if (!__atomic_compare_exchange_n(&lock->next, &ticket, owner + 1, false, __ATOMIC_ACQUIRE,
+                                   __ATOMIC_RELAXED)) {
+    return false;
+  }
+
+#if LOCK_STATS
+  lock->stats.acquires++;
+  lock->stats.hold_start = rdtsc();
+#endif
+
+  return true;
+}
+
+static inline void spin_unlock(spinlock_t* lock) {
+#if LOCK_STATS
+  uint64_t held = rdtsc() - lock->stats.hold_start;
+  if (held > lock->stats.max_hold_cycles) {
+    lock->stats.max_hold_cycles = held;
+  }
+#endif
+
+  __atomic_store_n(&lock->owner, lock->owner + 1, __ATOMIC_RELEASE);
+}
+
+// Disable interrupts and return the previous flags register so it can be restored later
+static inline uint64_t irq_save() {
+  uint64_t flags;
+  __asm__ volatile("pushfq; pop %0; cli" : "=r"(flags) : : "memory");
+  return flags;
+}
+
+// Enable interrupts unconditionally
+static inline void irq_enable() {
+  __asm__ volatile("sti" : : : "memory");
+}
+
+// Re-enable interrupts if they were enabled when the matching irq_save() was called
+static inline void irq_restore(uint64_t flags) {
+  if (flags & 0x200) {
+    __asm__ volatile("sti" : : : "memory");
+  }
+}
+
+/**
+ * Disable interrupts and take a spinlock. Use this for any lock an interrupt handler also takes,
+ * so the handler cannot spin forever on a lock its own CPU holds.
+ * \returns the interrupt flags to pass to spin_unlock_irqrestore()
+ */
+static inline uint64_t spin_lock_irqsave(spinlock_t* lock) {
+  uint64_t flags = irq_save();
+  spin_lock(lock);
+  return flags;
+}
+
+static inline void spin_unlock_irqrestore(spinlock_t* lock, uint64_t flags) {
+  spin_unlock(lock);
+  irq_restore(flags);
+}
+
+static inline void read_lock(rwlock_t* lock) {
+  spin_lock(&lock->writer);
+  __atomic_fetch_add(&lock->readers, 1, __ATOMIC_ACQUIRE);
+  spin_unlock(&lock->writer);
+}
+
+static inline void read_unlock(rwlock_t* lock) {
+  __atomic_fetch_sub(&lock->readers, 1, __ATOMIC_RELEASE);
+}
+
+static inline void write_lock(rwlock_t* lock) {
+  spin_lock(&lock->writer);
+
+  // New readers queue behind us; wait for the ones already inside to leave
+  while (__atomic_load_n(&lock->readers, __ATOMIC_ACQUIRE) != 0) {
+    __asm__ volatile("pause");
+  }
+}
+
+static inline void write_unlock(rwlock_t* lock) {
+  spin_unlock(&lock->writer);
+}
+
+// read_lock() with interrupts disabled. Returns the flags to pass to read_unlock_irqrestore().
+static inline uint64_t read_lock_irqsave(rwlock_t* lock) {
+  uint64_t flags = irq_save();
+  read_lock(lock);
+  return flags;
+}
+
+static inline void read_unlock_irqrestore(rwlock_t* lock, uint64_t flags) {
+  read_unlock(lock);
+  irq_restore(flags);
+}
+
+// write_lock() with interrupts disabled. Returns the flags to pass to write_unlock_irqrestore().
+static inline uint64_t write_lock_irqsave(rwlock_t* lock) {
+  uint64_t flags = irq_save();
+  write_lock(lock);
+  return flags;
+}
+
+static inline void write_unlock_irqrestore(rwlock_t* lock, uint64_t flags) {
+  write_unlock(lock);
+  irq_restore(flags);
+}
+
+/**
+ * Print a lock's counters. Prints nothing useful unless LOCK_STATS is enabled.
+ * \param name What to call the lock in the output
+ * \param lock The lock to report on
+ */
+void lock_print_stats(const char* name, spinlock_t* lock);
+
+// Print the counters of the kernel's global locks
+void lock_report();
@@ -1,6 +1,7 @@
 #include "mem.h"
-
-#define PAGE_SIZE 0x1000
+#include "cpu.h"
+#include "lock.h"
+#include "sched.h"
 
 // a page table entry
 typedef struct pt_entry {
@@ -12,41 +13,227 @@ typedef struct pt_entry {
   bool accessed : 1;
   bool dirty : 1;
   bool page_size : 1;
-  uint8_t _unused0 : 4;
+  bool global : 1;
+  bool cow : 1;         // available bit: the page is shared copy-on-write
+  uint8_t _unused0 : 2;
   uintptr_t address : 40;
   uint16_t _unused1 : 11;
   bool no_execute : 1;
 } __attribute__((packed)) pt_entry_t;
 
-// Define the structure of a node within the freelist
-typedef struct free_list_node {
-  struct free_list_node* next;
-} free_list_node_t;
+// Index into the page table at a level (1 is the lowest) for a virtual address
+#define PT_INDEX(address, level) (((address) >> (12 + 9 * ((level) - 1))) & 0x1FF)
+
+// Bytes mapped by a leaf entry at a level, and the allocation order of its frame
+#define LEVEL_SIZE(level) ((uint64_t) PAGE_SIZE << (9 * ((level) - 1)))
+#define LEVEL_ORDER(level) (9 * ((level) - 1))
+
+// Write protect bit in CR0
+#define CR0_WP (1 << 16)
+
+// Global page and process-context identifier enable bits in CR4
+#define CR4_PGE (1 << 7)
+#define CR4_PCIDE (1 << 17)
+
+// The PCID lives in the low 12 bits of CR3; setting bit 63 on a write keeps that PCID's entries
+#define CR3_PCID_MASK 0xFFF
+#define CR3_NOFLUSH (1UL << 63)
+#define MAX_PCID 4096
+
+// Range operations touching more pages than this reload CR3 rather than invalidating each page
+#define VM_FLUSH_THRESHOLD 32
+
+// A free block of physical memory. The node lives in the first page of the block itself.
+typedef struct free_block {
+  struct free_block* next;
+  struct free_block* prev;
+  uint8_t order;
+} free_block_t;
+
+// One doubly-linked free list per block order, indexed by order
+free_block_t* free_lists[PMEM_MAX_ORDER + 1];
+
+// One bit per physical frame, set when that frame is the head of a block on a free list
+uint64_t* free_bitmap = NULL;
+uint64_t free_bitmap_frames = 0;
+
+// One descriptor per physical frame, covering the same frames as the bitmap. A descriptor is only
+// meaningful once its frame has been allocated, so the array is never cleared as a whole.
+page_t* page_descriptors = NULL;
+
+// A range of usable physical memory that has not been handed to the buddy allocator yet
+typedef struct pmem_range {
+  uint64_t start;
+  uint64_t end;
+} pmem_range_t;
+
+#define PMEM_MAX_RANGES 64
+
+pmem_range_t pending_ranges[PMEM_MAX_RANGES];
+size_t pending_range_count = 0;
+
+// Protects the buddy free lists, the bitmap and the pending ranges
+spinlock_t pmem_lock;
+
+// Pages of usable memory, and how many of them the buddy allocator has handed out. Frames cached
+// in the per-CPU magazines and the zero pool count as handed out.
+uint64_t pmem_total_pages = 0;
+uint64_t pmem_allocated_pages = 0;
+
+// Each CPU caches single frames in a magazine so most pmem_alloc()/pmem_free() calls never touch
+// the shared buddy allocator. Magazines are refilled and spilled PMEM_MAGAZINE_BATCH at a time.
+#define PMEM_MAGAZINE_SIZE 64
+#define PMEM_MAGAZINE_BATCH 32
+
+typedef struct pmem_magazine {
+  uintptr_t frames[PMEM_MAGAZINE_SIZE];
+  size_t count;
+  uint64_t allocs;
+  uint64_t frees;
+  uint64_t hits;
+  uint64_t refills;
+  uint64_t spills;
+} pmem_magazine_t;
+
+pmem_magazine_t magazines[MAX_CPUS];
+
+// Set once CR4.PCIDE is on. Each new user address space then gets its own PCID, handed out
+// round-robin from 1; PCID 0 is left to the kernel's boot address space.
+bool pcid_enabled = false;
+uint16_t next_pcid = 1;
+
+// Cleared by the TLB benchmark so every switch drops the cached entries of the address space it
+// switches to, as a CR3 load does without PCIDs
+bool pcid_reuse = true;
+
+// A pool of frames that were zeroed while the CPU had nothing better to do. Once the pool drops
+// below the low watermark, idle time refills it up to the high watermark.
+#define ZERO_POOL_LOW 32
+#define ZERO_POOL_HIGH 128
+
+uintptr_t zero_pool[ZERO_POOL_HIGH];
+size_t zero_pool_count = 0;
+bool zero_pool_filling = false;
+uint64_t zero_pool_hits = 0;
+uint64_t zero_pool_misses = 0;
+spinlock_t zero_pool_lock;
+
+// Buddy allocator internals, called with pmem_lock held
+uintptr_t buddy_alloc(int order);
+void buddy_insert(uintptr_t p, int order);
+void buddy_free(uintptr_t p, int order);
+
+// Set by mem_features_init() when the CPU has fast `rep movsb`/`rep stosb` (ERMS) and fast short
+// `rep movsb` (FSRM)
+bool cpu_has_erms = false;
+bool cpu_has_fsrm = false;
+
+// Copies at least this long use `rep movsb`/`rep stosb` when the CPU has ERMS
+#define ERMS_THRESHOLD 128
+
+// An 8-byte load or store that may be unaligned and may alias anything
+typedef uint64_t __attribute__((may_alias, aligned(1))) unaligned_u64_t;
+
+// Check which string instruction variants are fast on this CPU
+void mem_features_init() {
+  uint32_t max_leaf, ebx, ecx, edx;
+  __asm__ volatile("cpuid" : "=a"(max_leaf), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0));
+
+  if (max_leaf < 7) {
+    return;
+  }
+
+  uint32_t eax;
+  __asm__ volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(7), "c"(0));
 
-free_list_node_t* free_list_head = NULL;
+  cpu_has_erms = (ebx >> 9) & 1;
+  cpu_has_fsrm = (edx >> 4) & 1;
+}
 
 // The  memset() function fills the first n bytes of the memory area pointed to by s with the constant byte c.
 void* memset(void* ptr, int c, size_t n) {
-  unsigned char* curr = ptr;
-  int i = 0;
+  void* dest = ptr;
 
-  while (i < n) {
-    *curr = (unsigned char) c;
-    curr++;
-    i++;
+  if (cpu_has_erms && n >= ERMS_THRESHOLD) {
+    __asm__ volatile("rep stosb" : "+D"(dest), "+c"(n) : "a"(c) : "memory");
+    return ptr;
   }
 
+  // Store eight copies of the byte at a time, then finish off the tail
+  uint64_t pattern = 0x0101010101010101UL * (unsigned char) c;
+  size_t qwords = n / 8;
+  size_t tail = n % 8;
+
+  __asm__ volatile("rep stosq" : "+D"(dest), "+c"(qwords) : "a"(pattern) : "memory");
+  __asm__ volatile("rep stosb" : "+D"(dest), "+c"(tail) : "a"(pattern) : "memory");
+
   return ptr;
 }
 
 void* memcpy(void* dest, const void* src, size_t size) {
-    char* target = (char*) dest;
-    char* source = (char*) src;
-    for(int i = 0; i < size; i++) {
-        target[i] = source[i];
-    }
+  void* target = dest;
 
+  if (cpu_has_fsrm || (cpu_has_erms && size >= ERMS_THRESHOLD)) {
+    __asm__ volatile("rep movsb" : "+D"(target), "+S"(src), "+c"(size) : : "memory");
     return dest;
+  }
+
+  // Copy eight bytes at a time, then finish off the tail
+  size_t qwords = size / 8;
+  size_t tail = size % 8;
+
+  __asm__ volatile("rep movsq" : "+D"(target), "+S"(src), "+c"(qwords) : : "memory");
+  __asm__ volatile("rep movsb" : "+D"(target), "+S"(src), "+c"(tail) : : "memory");
+
+  return dest;
+}
+
+// Copy size bytes from src to dest, where the two areas may overlap
+void* memmove(void* dest, const void* src, size_t size) {
+
+  // Copying forward is safe unless dest starts inside the source area
+  if ((uintptr_t) dest - (uintptr_t) src >= size) {
+    return memcpy(dest, src, size);
+  }
+
+  // Copy backward: the last size % 8 bytes one at a time, then whole qwords with the direction
+  // flag set
+  unsigned char* target = (unsigned char*) dest + size;
+  const unsigned char* source = (const unsigned char*) src + size;
+
+  for (size_t tail = size % 8; tail > 0; tail--) {
+    *--target = *--source;
+  }
+
+  size_t qwords = size / 8;
+  if (qwords > 0) {
+    target -= 8;
+    source -= 8;
+    __asm__ volatile("std; rep movsq; cld" : "+D"(target), "+S"(source), "+c"(qwords) : : "memory");
+  }
+
+  return dest;
+}
+
+// Compare the first size bytes of two areas, returning <0, 0 or >0 like strcmp
+int memcmp(const void* ptr1, const void* ptr2, size_t size) {
+  const unsigned char* a = ptr1;
+  const unsigned char* b = ptr2;
+
+  // Skip over equal qwords, then find the differing byte
+  while (size >= 8 && *(const unaligned_u64_t*) a == *(const unaligned_u64_t*) b) {
+    a += 8;
+    b += 8;
+    size -= 8;
+  }
+
+  for (size_t i = 0; i < size; i++) {
+    if (a[i] != b[i]) {
+      return a[i] - b[i];
+    }
+  }
+
+  return 0;
 }
 
 uint64_t hhdm_base;
@@ -65,6 +252,26 @@ void write_cr3(uint64_t value) {
   __asm__("mov %0, %%cr3" : : "r" (value));
 }
 
+uintptr_t read_cr0() {
+  uintptr_t value;
+  __asm__("mov %%cr0, %0" : "=r" (value));
+  return value;
+}
+
+void write_cr0(uint64_t value) {
+  __asm__("mov %0, %%cr0" : : "r" (value));
+}
+
+uintptr_t read_cr4() {
+  uintptr_t value;
+  __asm__ volatile("mov %%cr4, %0" : "=r" (value));
+  return value;
+}
+
+void write_cr4(uint64_t value) {
+  __asm__ volatile("mov %0, %%cr4" : : "r" (value) : "memory");
+}
+
 void invalidate_tlb(uintptr_t virtual_address) {
    __asm__("invlpg (%0)" :: "r" (virtual_address) : "memory");
 }
@@ -74,322 +281,1394 @@ uintptr_t get_top_table() {
   return read_cr3() & 0xFFFFFFFFFFFFF000;
 }
 
+// Is the frame at physical address p the head of a free block of the given order?
+bool block_is_free(uintptr_t p, int order) {
+  uint64_t frame = p >> 12;
+
+  if (frame >= free_bitmap_frames || !(free_bitmap[frame / 64] & (1UL << (frame % 64)))) {
+    return false;
+  }
+
+  free_block_t* block = (free_block_t*) (p + hhdm_base);
+  return block->order == order;
+}
+
+// Push the block at physical address p onto the free list for its order
+void free_list_push(uintptr_t p, int order) {
+  free_block_t* block = (free_block_t*) (p + hhdm_base);
+
+  block->order = order;
+  block->prev = NULL;
+  block->next = free_lists[order];
+
+  if (free_lists[order] != NULL) {
+    free_lists[order]->prev = block;
+  }
+
+  free_lists[order] = block;
+
+  uint64_t frame = p >> 12;
+  free_bitmap[frame / 64] |= 1UL << (frame % 64);
+}
+
+// Unlink a block from the middle of its free list and return its physical address
+uintptr_t free_list_remove(free_block_t* block) {
+  if (block->prev != NULL) {
+    block->prev->next = block->next;
+  } else {
+    free_lists[block->order] = block->next;
+  }
+
+  if (block->next != NULL) {
+    block->next->prev = block->prev;
+  }
+
+  uintptr_t p = (uintptr_t) block - hhdm_base;
+  uint64_t frame = p >> 12;
+  free_bitmap[frame / 64] &= ~(1UL << (frame % 64));
+
+  return p;
+}
+
+// The order of the largest naturally-aligned block that starts at start and ends by end
+int largest_block_order(uint64_t start, uint64_t end) {
+  int order = 63 - __builtin_clzl((end - start) >> 12);
+
+  int align = __builtin_ctzl(start >> 12);
+  if (align < order) {
+    order = align;
+  }
+
+  return (order > PMEM_MAX_ORDER) ? PMEM_MAX_ORDER : order;
+}
+
+// Hand the page-aligned physical range [start, end) to the buddy allocator as the largest
+// naturally-aligned blocks that fit
 void initialize_physical_area(uint64_t start, uint64_t end) {
+  while (start < end) {
+    int order = largest_block_order(start, end);
+    buddy_insert(start, order);
+    start += (uint64_t) PAGE_SIZE << order;
+  }
+}
 
-  uint64_t curr = start;
+/**
+ * Move one block from the front of a pending range onto the buddy free lists. This is the only
+ * place memory from the memory map is ever written to, so pages are touched on demand.
+ * \returns true if a block was carved, or false if every range has been used up
+ */
+bool pmem_carve_block() {
+  while (pending_range_count > 0) {
+    pmem_range_t* range = &pending_ranges[pending_range_count - 1];
 
-  while (curr < end) {
-    
-    if (free_list_head == NULL) {
-      free_list_node_t* node = (free_list_node_t*) (curr + hhdm_base);
-      free_list_head = node;
-    } else {
-      free_list_node_t* node = (free_list_node_t*) (curr + hhdm_base);
-      node->next = free_list_head;
-      free_list_head = node;
+    if (range->start >= range->end) {
+      pending_range_count--;
+      continue;
     }
 
-    curr += PAGE_SIZE;
+    int order = largest_block_order(range->start, range->end);
+    uint64_t block = range->start;
+    range->start += (uint64_t) PAGE_SIZE << order;
+
+    buddy_insert(block, order);
+    return true;
   }
+
+  return false;
 }
 
 void initialize_memory(struct stivale2_struct_tag_memmap* physical_tag, struct stivale2_struct_tag_hhdm* virtual_tag) {
 
   hhdm_base = virtual_tag->addr;
 
+  // Size the free bitmap to cover every frame that can ever be freed, which includes the
+  // bootloader's page tables released by unmap_lower_half(), and every frame that can be shared,
+  // which includes the boot modules
+  uint64_t top = 0;
   for (int i = 0; i < physical_tag->entries; i++) {
-
     struct stivale2_mmap_entry entry = physical_tag->memmap[i];
+    bool tracked = entry.type == STIVALE2_MMAP_USABLE || entry.type == STIVALE2_MMAP_BOOTLOADER_RECLAIMABLE ||
+                   entry.type == STIVALE2_MMAP_KERNEL_AND_MODULES;
 
-    if (entry.type == 1) {
-      uint64_t physical_start = entry.base;
-      uint64_t physical_end = entry.base + entry.length;
-      initialize_physical_area(physical_start, physical_end);
+    if (tracked && entry.base + entry.length > top) {
+      top = entry.base + entry.length;
     }
   }
-}
 
-/**
- * Allocate a page of physical memory.
- * \returns the physical address of the allocated physical memory or 0 on error.
- */
-uintptr_t pmem_alloc() {
-  if (free_list_head == NULL) {
-    return 0;
+  free_bitmap_frames = top >> 12;
+  uint64_t bitmap_size = ((free_bitmap_frames + 63) / 64) * sizeof(uint64_t);
+  bitmap_size = (bitmap_size + PAGE_SIZE - 1) & ~(uint64_t) (PAGE_SIZE - 1);
+  uint64_t descriptors_size = free_bitmap_frames * sizeof(page_t);
+  descriptors_size = (descriptors_size + PAGE_SIZE - 1) & ~(uint64_t) (PAGE_SIZE - 1);
+  uint64_t metadata_size = bitmap_size + descriptors_size;
+
+  // Carve the bitmap and frame descriptors out of the first usable area large enough to hold
+  // them. Clearing the bitmap is one sequential write of a bit per frame, rather than a list node
+  // per frame.
+  uint64_t bitmap_start = 0;
+  for (int i = 0; i < physical_tag->entries; i++) {
+    struct stivale2_mmap_entry entry = physical_tag->memmap[i];
+
+    if (entry.type == STIVALE2_MMAP_USABLE && entry.base != 0 && entry.length >= metadata_size) {
+      bitmap_start = entry.base;
+      break;
+    }
   }
 
-  uintptr_t val = (uintptr_t) free_list_head;
-  free_list_head = free_list_head->next;
+  free_bitmap = (uint64_t*) (bitmap_start + hhdm_base);
+  memset(free_bitmap, 0, bitmap_size);
+  page_descriptors = (page_t*) (bitmap_start + bitmap_size + hhdm_base);
 
-  return val - hhdm_base;
-}
+  // Record each usable area as a pending range; blocks are carved out of them on demand
+  for (int i = 0; i < physical_tag->entries; i++) {
 
-/**
- * Free a page of physical memory.
- * \param p is the physical address of the page to free, which must be page-aligned.
- */
-void pmem_free(uintptr_t p) {
+    struct stivale2_mmap_entry entry = physical_tag->memmap[i];
 
-  if ((void*) p == NULL) {
-    return;
-  }
+    if (entry.type == STIVALE2_MMAP_USABLE) {
+      uint64_t physical_start = (entry.base + PAGE_SIZE - 1) & ~(uint64_t) (PAGE_SIZE - 1);
+      uint64_t physical_end = (entry.base + entry.length) & ~(uint64_t) (PAGE_SIZE - 1);
 
-  if (free_list_head == NULL) {
-    free_list_node_t* node = (free_list_node_t*) (p + hhdm_base);
-    free_list_head = node;
-  } else {
-    free_list_node_t* node = (free_list_node_t*) (p + hhdm_base);
-    node->next = free_list_head;
-    free_list_head = node;
+      // Skip over the pages holding the bitmap and descriptors
+      if (entry.base == bitmap_start) {
+        physical_start += metadata_size;
+      }
+
+      // Physical address 0 doubles as the allocation failure value, so never hand it out
+      if (physical_start == 0) {
+        physical_start += PAGE_SIZE;
+      }
+
+      if (physical_start >= physical_end) {
+        continue;
+      }
+
+      pmem_total_pages += (physical_end - physical_start) / PAGE_SIZE;
+
+      if (pending_range_count < PMEM_MAX_RANGES) {
+        pending_ranges[pending_range_count].start = physical_start;
+        pending_ranges[pending_range_count].end = physical_end;
+        pending_range_count++;
+      } else {
+        // Out of range slots, so fall back to seeding the free lists right away
+        initialize_physical_area(physical_start, physical_end);
+      }
+    }
   }
+
+  // Make the kernel honor read-only pages too, so its writes to copy-on-write pages fault
+  write_cr0(read_cr0() | CR0_WP);
 }
 
-uintptr_t ptov(void* address) {
-  uint64_t address_int = (uint64_t) address;
-  return address_int + hhdm_base;
+/**
+ * Set the paging controls every CPU needs: write protection for the kernel, global pages, and
+ * PCIDs once tlb_setup() found them. Application processors call this before they run anything
+ * that touches user mappings.
+ */
+void mem_cpu_init() {
+  write_cr0(read_cr0() | CR0_WP);
+  write_cr4(read_cr4() | CR4_PGE | (pcid_enabled ? CR4_PCIDE : 0));
 }
 
-uintptr_t translate_virtual_to_physcial(void* address) {
+// Allocate a block from the buddy free lists. The caller must hold pmem_lock.
+uintptr_t buddy_alloc(int order) {
 
-  uintptr_t root = get_top_table(); // returns a physical address
+  // Find the smallest non-empty free list that can satisfy the request, carving more blocks
+  // out of the pending ranges if none can
+  int current;
+  do {
+    current = order;
+    while (current <= PMEM_MAX_ORDER && free_lists[current] == NULL) {
+      current++;
+    }
+  } while (current > PMEM_MAX_ORDER && pmem_carve_block());
 
-  pt_entry_t* table = root + hhdm_base;
+  if (current > PMEM_MAX_ORDER) {
+    return 0;
+  }
 
-  // Break the virtual address into pieces
-  uint64_t address_int = (uint64_t) address;
+  uintptr_t block = free_list_remove(free_lists[current]);
+  pmem_allocated_pages += (uint64_t) 1 << order;
 
-  uint64_t offset = address_int & 0xFFF;
-  uint16_t indices[] = {
-    (address_int >> 12) & 0x1FF,
-    (address_int >> 21) & 0x1FF,
-    (address_int >> 30) & 0x1FF,
-    (address_int >> 39) & 0x1FF
-  };
+  // Split the block, returning the upper halves to the free lists until it is the right size
+  while (current > order) {
+    current--;
+    free_list_push(block + ((uintptr_t) PAGE_SIZE << current), current);
+  }
 
-  bool isFound = true;
+  return block;
+}
 
-  for (int i = 3; i >= 1; i--) {
+// Put a block on the buddy free lists, merging it with its buddies. The caller must hold
+// pmem_lock.
+void buddy_insert(uintptr_t p, int order) {
 
-    // get the current entry
-    pt_entry_t* curr_entry = table + indices[i];
+  // Coalesce with the buddy block for as long as the buddy is also free
+  while (order < PMEM_MAX_ORDER) {
+    uintptr_t buddy = p ^ ((uintptr_t) PAGE_SIZE << order);
 
-    if (!curr_entry->present) {
-      isFound = false;
+    if (!block_is_free(buddy, order)) {
       break;
     }
 
-    // advance pointer to next level of table
-    table = (curr_entry->address << 12) + hhdm_base;
+    free_list_remove((free_block_t*) (buddy + hhdm_base));
+    p &= ~((uintptr_t) PAGE_SIZE << order);
+    order++;
   }
 
-  return (isFound) ? (uintptr_t) table + indices[0] + offset - hhdm_base : 0;
+  free_list_push(p, order);
+}
+
+// Return an allocated block to the buddy free lists. The caller must hold pmem_lock.
+void buddy_free(uintptr_t p, int order) {
+  pmem_allocated_pages -= (uint64_t) 1 << order;
+  buddy_insert(p, order);
 }
 
 /**
- * Map a single page of memory into a virtual address space.
- * \param root The physical address of the top-level page table structure
- * \param address The virtual address to map into the address space, must be page-aligned
- * \param user Should the page be user-accessible?
- * \param writable Should the page be writable?
- * \param executable Should the page be executable?
- * \returns true if the mapping succeeded, or false if there was an error
+ * Allocate a naturally-aligned block of 2^order contiguous pages of physical memory.
+ * \param order The base-2 logarithm of the number of pages to allocate
+ * \returns the physical address of the first page of the block or 0 on error.
  */
-bool vm_map(uintptr_t root, uintptr_t address, bool user, bool writable, bool executable) {
+uintptr_t pmem_alloc_pages(int order) {
+  if (order < 0 || order > PMEM_MAX_ORDER) {
+    return 0;
+  }
 
-  pt_entry_t* table = root + hhdm_base;
+  uint64_t flags = spin_lock_irqsave(&pmem_lock);
+  uintptr_t block = buddy_alloc(order);
+  spin_unlock_irqrestore(&pmem_lock, flags);
 
-  uint16_t indices[] = {
-    (address >> 12) & 0x1FF,
-    (address >> 21) & 0x1FF,
-    (address >> 30) & 0x1FF,
-    (address >> 39) & 0x1FF // The fourth (highest) table index
-  };
+  if (block != 0) {
+    page_descriptors[block >> 12].refcount = 1;
+  }
 
-  pt_entry_t* curr_entry = NULL;
+  return block;
+}
 
-  // Traverse down the virtual address to level 1
-  for (int i = 3; i >= 1; i--) {
+/**
+ * Free a block of physical memory allocated with pmem_alloc_pages, merging it with its buddies.
+ * \param p is the physical address of the block, which must be aligned to its size.
+ * \param order is the order the block was allocated with.
+ */
+void pmem_free_pages(uintptr_t p, int order) {
 
-    curr_entry = (table + indices[i]);
+  if ((void*) p == NULL || order < 0 || order > PMEM_MAX_ORDER) {
+    return;
+  }
 
-    if (curr_entry->present) {
-      table = (curr_entry->address << 12) + hhdm_base;
-    } else {
-      // Make a pt_entry_t on the current level, set to present
-      curr_entry->present = 1;
-      curr_entry->user = 1;
-      curr_entry->writable = 1;
-      curr_entry->no_execute = 0;
+  uint64_t flags = spin_lock_irqsave(&pmem_lock);
+  buddy_free(p, order);
+  spin_unlock_irqrestore(&pmem_lock, flags);
+}
+
+/**
+ * Allocate a page of physical memory. Pages come from the current CPU's magazine, which is
+ * refilled from the buddy allocator in batches.
+ * \returns the physical address of the allocated physical memory or 0 on error.
+ */
+uintptr_t pmem_alloc() {
+  uint64_t flags = irq_save();
+  pmem_magazine_t* magazine = &magazines[cpu_id()];
 
-      // Make a page table on the below level and initialize it to all not presents
-      uintptr_t newly_created_table = pmem_alloc();
+  if (magazine->count == 0) {
+    magazine->refills++;
 
-      // We have no more physical memory left! we must fail the mapping
-      if (newly_created_table == 0) {
-        return false;
-      }
+    spin_lock(&pmem_lock);
+    while (magazine->count < PMEM_MAGAZINE_BATCH) {
+      // buddy_alloc() takes single pages straight off the order-0 list when it has any, and
+      // keeps the count of allocated pages that pmem_get_usage() reports
+      uintptr_t p = buddy_alloc(0);
 
-      // Set the table to all 0s
-      memset((void*) newly_created_table + hhdm_base, 0, 4096);
+      if (p == 0) {
+        break;
+      }
 
-      // Make our current pt_entry_t point to this newly created table
-      curr_entry->address = newly_created_table >> 12;
-      table = (curr_entry->address << 12) + hhdm_base;
+      magazine->frames[magazine->count++] = p;
     }
+    spin_unlock(&pmem_lock);
+  } else {
+    magazine->hits++;
   }
 
-  pt_entry_t* dest = table + indices[0];
-  
-  dest->address = pmem_alloc() >> 12;
-  dest->present = 1;
-  dest->user = user;
-  dest->writable = writable;
-  dest->no_execute = !executable;
+  uintptr_t p = 0;
+  if (magazine->count > 0) {
+    p = magazine->frames[--magazine->count];
+    page_descriptors[p >> 12].refcount = 1;
+  }
 
-  invalidate_tlb(address);
+  magazine->allocs++;
+  irq_restore(flags);
 
-  return true;
+  return p;
 }
 
 /**
- * Unmap a page from a virtual address space
- * \param root The physical address of the top-level page table structure
- * \param address The virtual address to unmap from the address space
- * \returns true if successful, or false if anything goes wrong
+ * Free a page of physical memory. The page goes back to the current CPU's magazine, and half of
+ * a full magazine is spilled back to the buddy allocator at once.
+ * \param p is the physical address of the page to free, which must be page-aligned.
  */
-bool vm_unmap(uintptr_t root, uintptr_t address) {
-
-  pt_entry_t* table = (pt_entry_t*) (root + hhdm_base);
-
-  uint16_t indices[] = {
-    (address >> 12) & 0x1FF,
-    (address >> 21) & 0x1FF,
-    (address >> 30) & 0x1FF,
-    (address >> 39) & 0x1FF
-  };
+void pmem_free(uintptr_t p) {
 
-  pt_entry_t* curr_entry = NULL;
+  if ((void*) p == NULL) {
+    return;
+  }
 
-  for (int i = 3; i >= 1; i--) {
+  uint64_t flags = irq_save();
+  pmem_magazine_t* magazine = &magazines[cpu_id()];
 
-    curr_entry = (pt_entry_t*) (table + indices[i]);
+  if (magazine->count == PMEM_MAGAZINE_SIZE) {
+    magazine->spills++;
 
-    if (curr_entry->present) {
-      table = (pt_entry_t*) (curr_entry->address << 12);
-    } else {
-      return false;
+    spin_lock(&pmem_lock);
+    for (size_t i = 0; i < PMEM_MAGAZINE_BATCH; i++) {
+      buddy_free(magazine->frames[--magazine->count], 0);
     }
+    spin_unlock(&pmem_lock);
   }
 
-  pt_entry_t* bottom_entry = (pt_entry_t*) (table + indices[0]);
-
-  if (bottom_entry->present) {
-    uintptr_t virtual_to_free = table + indices[0];
-    uintptr_t physical_to_free = virtual_to_free - hhdm_base;
-    pmem_free(physical_to_free);
-    return true;
-  }
-
-  invalidate_tlb(address); 
-
-  return false;
+  magazine->frames[magazine->count++] = p;
+  magazine->frees++;
+  irq_restore(flags);
 }
 
 /**
- * Change the protections for a page in a virtual address space
- * \param root The physical address of the top-level page table structure
- * \param address The virtual address to update
- * \param user Should the page be user-accessible or kernel only?
- * \param writable Should the page be writable?
- * \param executable Should the page be executable?
- * \returns true if successful, or false if anything goes wrong (e.g. page is not mapped)
+ * Read the page magazine counters for a CPU.
+ * \param cpu The index of the CPU to read counters for
+ * \param stats Filled in with the counters
  */
-bool vm_protect(uintptr_t root, uintptr_t address, bool user, bool writable, bool executable) {
+void pmem_get_magazine_stats(uint32_t cpu, pmem_magazine_stats_t* stats) {
+  pmem_magazine_t* magazine = &magazines[cpu];
+
+  stats->allocs = magazine->allocs;
+  stats->frees = magazine->frees;
+  stats->hits = magazine->hits;
+  stats->refills = magazine->refills;
+  stats->spills = magazine->spills;
+  stats->cached = magazine->count;
+}
 
-  pt_entry_t* table = root + hhdm_base;
+// Zero one page with a single string instruction rather than the byte-at-a-time memset
+void zero_page(void* page) {
+  uint64_t count = PAGE_SIZE / sizeof(uint64_t);
+  __asm__ volatile("rep stosq" : "+D"(page), "+c"(count) : "a"(0) : "memory");
+}
 
-  uint16_t indices[] = {
-    (address >> 12) & 0x1FF,
-    (address >> 21) & 0x1FF,
-    (address >> 30) & 0x1FF,
-    (address >> 39) & 0x1FF
-  };
+/**
+ * Allocate a page of physical memory that is filled with zeros. Pages come from the pool zeroed
+ * at idle time, and are only zeroed here if the pool is empty.
+ * \returns the physical address of the allocated physical memory or 0 on error.
+ */
+uintptr_t pmem_alloc_zeroed() {
+  uint64_t flags = spin_lock_irqsave(&zero_pool_lock);
 
-  pt_entry_t* curr_entry = NULL;
+  uintptr_t frame = 0;
+  if (zero_pool_count > 0) {
+    frame = zero_pool[--zero_pool_count];
+    zero_pool_hits++;
+  } else {
+    zero_pool_misses++;
+  }
 
-  for (int i = 3; i >= 1; i--) {
+  spin_unlock_irqrestore(&zero_pool_lock, flags);
 
-    curr_entry = table + indices[i];
+  if (frame == 0) {
+    frame = pmem_alloc();
 
-    if (curr_entry->present) {
-      table = (curr_entry->address << 12) + hhdm_base;
-    } else {
-      return false;
+    if (frame != 0) {
+      zero_page((void*) (frame + hhdm_base));
     }
   }
 
-  pt_entry_t* bottom_entry = table + indices[0];
-
-  if (bottom_entry->present) {
-    bottom_entry->user = user;
-    bottom_entry->writable = writable;
-    bottom_entry->no_execute = !executable;
-    return true;
-  }
-
-  invalidate_tlb(address);
-
-  return false;
+  return frame;
 }
 
-// Unmap everything in the lower half of an address space with level 4 page table at address root
-void unmap_lower_half() {
+/**
+ * Do one page worth of background work on the zeroed-frame pool. Call this whenever the CPU would
+ * otherwise sit idle; interrupts stay enabled while the page is zeroed.
+ * \returns true if a page was zeroed, or false if the pool needs nothing right now
+ */
+bool pmem_zero_pool_fill_one() {
+  uint64_t flags = spin_lock_irqsave(&zero_pool_lock);
+
+  // Start filling only once the pool falls below the low watermark, then keep going to the high one
+  if (zero_pool_count < ZERO_POOL_LOW) {
+    zero_pool_filling = true;
+  } else if (zero_pool_count >= ZERO_POOL_HIGH) {
+    zero_pool_filling = false;
+  }
 
-  uintptr_t root = get_top_table();
+  bool filling = zero_pool_filling;
 
-  // We can reclaim memory used to hold page tables, but NOT the mapped pages
-  pt_entry_t* l4_table = (pt_entry_t*) ptov((void*) root);
+  spin_unlock_irqrestore(&zero_pool_lock, flags);
 
-  for (size_t l4_index = 0; l4_index < 256; l4_index++) {
+  if (!filling) {
+    return false;
+  }
 
-    // kprint_f("the 4: %dth table at %p is present: %d\n", l4_index, l4_table[l4_index], l4_table[l4_index].present);
+  uintptr_t frame = pmem_alloc();
 
-    // Does this entry point to a level 3 table?
-    if (l4_table[l4_index].present) {
+  if (frame == 0) {
+    return false;
+  }
 
-      // Yes. Mark the entry as not present in the level 4 table
-      l4_table[l4_index].present = false;
+  zero_page((void*) (frame + hhdm_base));
 
-      // Now loop over the level 3 table
-      pt_entry_t* l3_table = (pt_entry_t*) ptov((void*) (l4_table[l4_index].address << 12));
-      for (size_t l3_index = 0; l3_index < 512; l3_index++) {
+  flags = spin_lock_irqsave(&zero_pool_lock);
 
+  if (zero_pool_count < ZERO_POOL_HIGH) {
+    zero_pool[zero_pool_count++] = frame;
+    frame = 0;
+  }
 
-        // Does this entry point to a level 2 table?
-        if (l3_table[l3_index].present && !l3_table[l3_index].page_size) {
+  spin_unlock_irqrestore(&zero_pool_lock, flags);
 
-          // Yes. Loop over the level 2 table
-          pt_entry_t* l2_table = (pt_entry_t*) ptov((void*) (l3_table[l3_index].address << 12));
-          for (size_t l2_index = 0; l2_index < 512; l2_index++) {
+  // Another CPU filled the pool first
+  if (frame != 0) {
+    pmem_free(frame);
+  }
 
-            // Does this entry point to a level 1 table?
-            if (l2_table[l2_index].present && !l2_table[l2_index].page_size) {
+  return true;
+}
 
-              // Yes. Free the physical page the holds the level 1 table
-              pmem_free(l2_table[l2_index].address << 12);
-            }
-          }
+/**
+ * Read the zeroed-frame pool counters.
+ * \param stats Filled in with the counters
+ */
+void pmem_get_zero_pool_stats(pmem_zero_pool_stats_t* stats) {
+  stats->hits = zero_pool_hits;
+  stats->misses = zero_pool_misses;
+  stats->cached = zero_pool_count;
+}
 
-          // Free the physical page that held the level 2 table
-          pmem_free(l3_table[l3_index].address << 12);
-        }
-      }
+/**
+ * Read how much physical memory there is and how much is free. Frames cached per CPU or in the
+ * zero pool count as in use, and the counts are a snapshot that may already be stale.
+ * \param usage Filled in with the page counts
+ */
+void pmem_get_usage(pmem_usage_t* usage) {
+  usage->total_pages = pmem_total_pages;
+  usage->free_pages = pmem_total_pages - __atomic_load_n(&pmem_allocated_pages, __ATOMIC_RELAXED);
+}
 
-      // Free the physical page that held the level 3 table
-      pmem_free(l4_table[l4_index].address << 12);
-    }
+/**
+ * Take another reference to an allocated frame, for example to map it a second time.
+ * \param p The physical address of the frame
+ */
+void pmem_ref(uintptr_t p) {
+  if ((p >> 12) < free_bitmap_frames) {
+    __atomic_add_fetch(&page_descriptors[p >> 12].refcount, 1, __ATOMIC_RELAXED);
   }
+}
 
-  // Reload CR3 to flush any cached address translations
-  write_cr3(read_cr3());
+/**
+ * Give a frame the allocator never handed out, such as one holding a boot module, a single
+ * permanent reference. Mappings can then share it with pmem_ref/pmem_unref and it is never freed.
+ * \param p The physical address of the frame
+ */
+void pmem_pin(uintptr_t p) {
+  if ((p >> 12) < free_bitmap_frames) {
+    __atomic_store_n(&page_descriptors[p >> 12].refcount, 1, __ATOMIC_RELEASE);
+  }
+}
+
+/**
+ * Drop a reference to a single allocated frame, freeing it when no references remain.
+ * \param p The physical address of the frame
+ */
+void pmem_unref(uintptr_t p) {
+  if ((p >> 12) >= free_bitmap_frames) {
+    return;
+  }
+
+  if (__atomic_sub_fetch(&page_descriptors[p >> 12].refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+    pmem_free(p);
+  }
+}
+
+// Get the number of references to an allocated frame
+uint32_t pmem_refcount(uintptr_t p) {
+  if ((p >> 12) >= free_bitmap_frames) {
+    return 0;
+  }
+
+  return __atomic_load_n(&page_descriptors[p >> 12].refcount, __ATOMIC_ACQUIRE);
+}
+
+uintptr_t ptov(void* address) {
+  uint64_t address_int = (uint64_t) address;
+  return address_int + hhdm_base;
+}
+
+// Apply VM_* protection flags to a leaf entry. Copy-on-write pages stay read-only until the
+// write fault that copies them.
+void pt_set_flags(pt_entry_t* entry, int flags) {
+  entry->user = (flags & VM_USER) != 0;
+  entry->writable = (flags & VM_WRITABLE) && !entry->cow;
+  entry->no_execute = !(flags & VM_EXECUTABLE);
+}
+
+// Release the frame behind a leaf entry at the given level and mark the entry not present
+void pt_release(pt_entry_t* entry, int level) {
+  uintptr_t frame = (uintptr_t) entry->address << 12;
+
+  if (level == 1) {
+    pmem_unref(frame);
+  } else {
+    pmem_free_pages(frame, LEVEL_ORDER(level));
+  }
+
+  entry->present = 0;
+  entry->page_size = 0;
+  entry->cow = 0;
+}
+
+/**
+ * Find the entry that maps a virtual address, stopping early at huge page entries.
+ * \param root The physical address of the top-level page table structure
+ * \param address The virtual address to look up
+ * \param level Set to the level of the returned entry (1 for 4 KiB, 2 for 2 MiB, 3 for 1 GiB)
+ * \returns a pointer to the present leaf entry, or NULL if the address is not mapped
+ */
+pt_entry_t* vm_lookup(uintptr_t root, uintptr_t address, int* level) {
+
+  pt_entry_t* table = (pt_entry_t*) (root + hhdm_base);
+
+  for (int i = 4; i >= 1; i--) {
+
+    pt_entry_t* curr_entry = table + PT_INDEX(address, i);
+
+    if (!curr_entry->present) {
+      return NULL;
+    }
+
+    // A huge page or a level 1 entry is the end of the walk
+    if (i == 1 || (i <= 3 && curr_entry->page_size)) {
+      *level = i;
+      return curr_entry;
+    }
+
+    // advance pointer to next level of table
+    table = (pt_entry_t*) (((uintptr_t) curr_entry->address << 12) + hhdm_base);
+  }
+
+  return NULL;
+}
+
+/**
+ * Find the entry for a virtual address at the given level, creating any missing intermediate
+ * tables on the way down.
+ * \param root The physical address of the top-level page table structure
+ * \param address The virtual address to look up
+ * \param level The level of the entry to return (1 for 4 KiB, 2 for 2 MiB, 3 for 1 GiB)
+ * \returns a pointer to the entry, or NULL if memory ran out or a huge page covers the address
+ */
+pt_entry_t* vm_walk_create(uintptr_t root, uintptr_t address, int level) {
+
+  pt_entry_t* table = (pt_entry_t*) (root + hhdm_base);
+
+  // Traverse down the virtual address to the requested level
+  for (int i = 4; i > level; i--) {
+
+    pt_entry_t* curr_entry = table + PT_INDEX(address, i);
+
+    if (!curr_entry->present) {
+      // Make a page table on the below level, initialized to all not presents
+      uintptr_t newly_created_table = pmem_alloc_zeroed();
+
+      // We have no more physical memory left! we must fail the mapping
+      if (newly_created_table == 0) {
+        return NULL;
+      }
+
+      // Make our current pt_entry_t point to this newly created table and set it to present
+      curr_entry->address = newly_created_table >> 12;
+      curr_entry->present = 1;
+      curr_entry->user = 1;
+      curr_entry->writable = 1;
+      curr_entry->no_execute = 0;
+
+    } else if (curr_entry->page_size) {
+      // A huge page already maps this address, so there is no lower table to descend into
+      return NULL;
+    }
+
+    table = (pt_entry_t*) (((uintptr_t) curr_entry->address << 12) + hhdm_base);
+  }
+
+  return table + PT_INDEX(address, level);
+}
+
+uintptr_t translate_virtual_to_physcial(void* address) {
+
+  uintptr_t root = get_top_table(); // returns a physical address
+
+  int level;
+  pt_entry_t* entry = vm_lookup(root, (uintptr_t) address, &level);
+
+  if (entry == NULL) {
+    return 0;
+  }
+
+  // The offset into the page is every address bit below the level's index bits
+  uint64_t offset = (uintptr_t) address & (LEVEL_SIZE(level) - 1);
+
+  return ((uintptr_t) entry->address << 12) + offset;
+}
+
+/**
+ * Map an already-allocated frame into a virtual address space.
+ * \param root The physical address of the top-level page table structure
+ * \param address The virtual address to map, which must be aligned to page_size
+ * \param frame The physical address of the frame, which must also be aligned to page_size
+ * \param page_size One of PAGE_SIZE, PAGE_SIZE_2M or PAGE_SIZE_1G
+ * \param flags A combination of VM_USER, VM_WRITABLE and VM_EXECUTABLE
+ * \returns true if the mapping succeeded, or false if there was an error
+ */
+bool vm_map_frame(uintptr_t root, uintptr_t address, uintptr_t frame, size_t page_size, int flags) {
+
+  int level;
+  if (page_size == PAGE_SIZE) {
+    level = 1;
+  } else if (page_size == PAGE_SIZE_2M) {
+    level = 2;
+  } else if (page_size == PAGE_SIZE_1G) {
+    level = 3;
+  } else {
+    return false;
+  }
+
+  if ((address | frame) & (page_size - 1)) {
+    return false;
+  }
+
+  pt_entry_t* dest = vm_walk_create(root, address, level);
+
+  // Refuse to replace a lower-level table that may still hold 4 KiB mappings
+  if (dest == NULL || (level > 1 && dest->present)) {
+    return false;
+  }
+
+  dest->address = frame >> 12;
+  dest->present = 1;
+  dest->page_size = level > 1;
+  dest->cow = 0;
+  pt_set_flags(dest, flags);
+
+  invalidate_tlb(address);
+
+  return true;
+}
+
+/**
+ * Map a single page of memory into a virtual address space.
+ * \param root The physical address of the top-level page table structure
+ * \param address The virtual address to map into the address space, must be page-aligned
+ * \param user Should the page be user-accessible?
+ * \param writable Should the page be writable?
+ * \param executable Should the page be executable?
+ * \returns true if the mapping succeeded, or false if there was an error
+ */
+bool vm_map(uintptr_t root, uintptr_t address, bool user, bool writable, bool executable) {
+  return vm_map_huge(root, address, PAGE_SIZE, user, writable, executable);
+}
+
+/**
+ * Map a single 2 MiB or 1 GiB page of memory into a virtual address space.
+ * \param root The physical address of the top-level page table structure
+ * \param address The virtual address to map, which must be aligned to page_size
+ * \param page_size Either PAGE_SIZE_2M or PAGE_SIZE_1G (PAGE_SIZE maps a normal page)
+ * \param user Should the page be user-accessible?
+ * \param writable Should the page be writable?
+ * \param executable Should the page be executable?
+ * \returns true if the mapping succeeded, or false if there was an error
+ */
+bool vm_map_huge(uintptr_t root, uintptr_t address, size_t page_size, bool user, bool writable, bool executable) {
+
+  int order;
+  if (page_size == PAGE_SIZE) {
+    order = 0;
+  } else if (page_size == PAGE_SIZE_2M) {
+    order = LEVEL_ORDER(2);
+  } else if (page_size == PAGE_SIZE_1G) {
+    order = LEVEL_ORDER(3);
+  } else {
+    return false;
+  }
+
+  uintptr_t frame = (order == 0) ? pmem_alloc() : pmem_alloc_pages(order);
+
+  if (frame == 0) {
+    return false;
+  }
+
+  int flags = (user ? VM_USER : 0) | (writable ? VM_WRITABLE : 0) | (executable ? VM_EXECUTABLE : 0);
+
+  if (!vm_map_frame(root, address, frame, page_size, flags)) {
+    if (order == 0) {
+      pmem_free(frame);
+    } else {
+      pmem_free_pages(frame, order);
+    }
+    return false;
+  }
+
+  return true;
+}
+
+/**
+ * Map a region of memory, using 1 GiB and 2 MiB pages wherever an aligned piece of the region is
+ * large enough and 4 KiB pages everywhere else.
+ * \param root The physical address of the top-level page table structure
+ * \param address The start of the region, must be page-aligned
+ * \param length The length of the region in bytes, rounded up to a whole number of pages
+ * \param user Should the pages be user-accessible?
+ * \param writable Should the pages be writable?
+ * \param executable Should the pages be executable?
+ * \returns true if the whole region was mapped, or false if there was an error
+ */
+bool vm_map_region(uintptr_t root, uintptr_t address, size_t length, bool user, bool writable, bool executable) {
+
+  uintptr_t end = address + ((length + PAGE_SIZE - 1) & ~(uintptr_t) (PAGE_SIZE - 1));
+
+  while (address < end) {
+    bool res;
+
+    if ((address & (PAGE_SIZE_1G - 1)) == 0 && end - address >= PAGE_SIZE_1G &&
+        vm_map_huge(root, address, PAGE_SIZE_1G, user, writable, executable)) {
+      address += PAGE_SIZE_1G;
+      continue;
+    }
+
+    if ((address & (PAGE_SIZE_2M - 1)) == 0 && end - address >= PAGE_SIZE_2M &&
+        vm_map_huge(root, address, PAGE_SIZE_2M, user, writable, executable)) {
+      address += PAGE_SIZE_2M;
+      continue;
+    }
+
+    // Fall back to normal pages up to the next 2 MiB boundary if no huge page fits or none could
+    // be allocated, mapping them all with one walk
+    uintptr_t run_end = (address + PAGE_SIZE_2M) & ~(uintptr_t) (PAGE_SIZE_2M - 1);
+    if (run_end > end) {
+      run_end = end;
+    }
+
+    int flags = (user ? VM_USER : 0) | (writable ? VM_WRITABLE : 0) | (executable ? VM_EXECUTABLE : 0);
+    res = vm_map_range(root, address, (run_end - address) / PAGE_SIZE, flags);
+
+    if (!res) {
+      return false;
+    }
+
+    address = run_end;
+  }
+
+  return true;
+}
+
+/**
+ * Unmap a page from a virtual address space. If the address is the start of a huge page, the
+ * whole huge page is unmapped.
+ * \param root The physical address of the top-level page table structure
+ * \param address The virtual address to unmap from the address space
+ * \returns true if successful, or false if anything goes wrong
+ */
+bool vm_unmap(uintptr_t root, uintptr_t address) {
+
+  int level;
+  pt_entry_t* bottom_entry = vm_lookup(root, address, &level);
+
+  // Huge pages can only be unmapped as a whole
+  if (bottom_entry == NULL || (address & (LEVEL_SIZE(level) - 1))) {
+    return false;
+  }
+
+  pt_release(bottom_entry, level);
+
+  invalidate_tlb(address);
+
+  return true;
+}
+
+/**
+ * Change the protections for a page in a virtual address space. If the address falls in a huge
+ * page, the protections of the whole huge page change.
+ * \param root The physical address of the top-level page table structure
+ * \param address The virtual address to update
+ * \param user Should the page be user-accessible or kernel only?
+ * \param writable Should the page be writable?
+ * \param executable Should the page be executable?
+ * \returns true if successful, or false if anything goes wrong (e.g. page is not mapped)
+ */
+bool vm_protect(uintptr_t root, uintptr_t address, bool user, bool writable, bool executable) {
+
+  int level;
+  pt_entry_t* bottom_entry = vm_lookup(root, address, &level);
+
+  if (bottom_entry == NULL) {
+    return false;
+  }
+
+  int flags = (user ? VM_USER : 0) | (writable ? VM_WRITABLE : 0) | (executable ? VM_EXECUTABLE : 0);
+  pt_set_flags(bottom_entry, flags);
+
+  invalidate_tlb(address);
+
+  return true;
+}
+
+// Invalidate the TLB entries for a batch of pages once the whole batch has been updated. Large
+// batches reload CR3 instead, which is cheaper than hundreds of invlpg instructions.
+void vm_flush_range(uintptr_t start, size_t npages) {
+  if (npages > VM_FLUSH_THRESHOLD) {
+    write_cr3(read_cr3());
+    return;
+  }
+
+  for (size_t i = 0; i < npages; i++) {
+    invalidate_tlb(start + i * PAGE_SIZE);
+  }
+}
+
+/**
+ * Map a run of pages into a virtual address space with a single page table walk. The walk is
+ * only repeated when the run crosses into a new level 1 table, and the TLB is flushed once.
+ * \param root The physical address of the top-level page table structure
+ * \param start The first virtual address to map, must be page-aligned
+ * \param npages The number of 4 KiB pages to map
+ * \param flags A combination of VM_USER, VM_WRITABLE and VM_EXECUTABLE
+ * \returns true if every page was mapped, or false if there was an error
+ */
+bool vm_map_range(uintptr_t root, uintptr_t start, size_t npages, int flags) {
+
+  pt_entry_t* table = NULL;
+  size_t i;
+
+  for (i = 0; i < npages; i++) {
+    uintptr_t address = start + i * PAGE_SIZE;
+
+    // Walk again only when the cursor moves past the end of the current level 1 table
+    if (table == NULL || PT_INDEX(address, 1) == 0) {
+      pt_entry_t* entry = vm_walk_create(root, address, 1);
+
+      if (entry == NULL) {
+        break;
+      }
+
+      table = entry - PT_INDEX(address, 1);
+    }
+
+    uintptr_t frame = pmem_alloc();
+
+    if (frame == 0) {
+      break;
+    }
+
+    pt_entry_t* dest = table + PT_INDEX(address, 1);
+    dest->address = frame >> 12;
+    dest->present = 1;
+    dest->cow = 0;
+    pt_set_flags(dest, flags);
+  }
+
+  vm_flush_range(start, i);
+
+  return i == npages;
+}
+
+/**
+ * Change the protections for a run of pages, walking the page tables once per level 1 table and
+ * flushing the TLB once. Huge pages in the run change protection as a whole.
+ * \param root The physical address of the top-level page table structure
+ * \param start The first virtual address to update, must be page-aligned
+ * \param npages The number of 4 KiB pages to update
+ * \param flags A combination of VM_USER, VM_WRITABLE and VM_EXECUTABLE
+ * \returns true if every page was mapped, or false if some pages were not
+ */
+bool vm_protect_range(uintptr_t root, uintptr_t start, size_t npages, int flags) {
+
+  pt_entry_t* table = NULL;
+  bool all_mapped = true;
+  size_t i = 0;
+
+  while (i < npages) {
+    uintptr_t address = start + i * PAGE_SIZE;
+    pt_entry_t* entry;
+    size_t step = 1;
+
+    if (table != NULL && PT_INDEX(address, 1) != 0) {
+      entry = table + PT_INDEX(address, 1);
+    } else {
+      int level;
+      entry = vm_lookup(root, address, &level);
+      table = NULL;
+
+      if (entry != NULL && level == 1) {
+        table = entry - PT_INDEX(address, 1);
+      } else if (entry != NULL) {
+        // Skip over the rest of the huge page
+        step = (LEVEL_SIZE(level) - (address & (LEVEL_SIZE(level) - 1))) / PAGE_SIZE;
+      }
+    }
+
+    if (entry != NULL && entry->present) {
+      pt_set_flags(entry, flags);
+    } else {
+      all_mapped = false;
+    }
+
+    i += step;
+  }
+
+  vm_flush_range(start, npages);
+
+  return all_mapped;
+}
+
+/**
+ * Unmap a run of pages and free the frames behind them, walking the page tables once per level 1
+ * table and flushing the TLB once. Huge pages are only unmapped if the run covers all of them.
+ * \param root The physical address of the top-level page table structure
+ * \param start The first virtual address to unmap, must be page-aligned
+ * \param npages The number of 4 KiB pages to unmap
+ * \returns true if every page was unmapped, or false if some pages were not
+ */
+bool vm_unmap_range(uintptr_t root, uintptr_t start, size_t npages) {
+
+  pt_entry_t* table = NULL;
+  bool all_unmapped = true;
+  size_t i = 0;
+
+  while (i < npages) {
+    uintptr_t address = start + i * PAGE_SIZE;
+    pt_entry_t* entry;
+    int level = 1;
+    size_t step = 1;
+
+    if (table != NULL && PT_INDEX(address, 1) != 0) {
+      entry = table + PT_INDEX(address, 1);
+    } else {
+      entry = vm_lookup(root, address, &level);
+      table = NULL;
+
+      if (entry != NULL && level == 1) {
+        table = entry - PT_INDEX(address, 1);
+      } else if (entry != NULL) {
+        step = (LEVEL_SIZE(level) - (address & (LEVEL_SIZE(level) - 1))) / PAGE_SIZE;
+      }
+    }
+
+    bool whole = level == 1 || ((address & (LEVEL_SIZE(level) - 1)) == 0 && npages - i >= step);
+
+    if (entry != NULL && entry->present && whole) {
+      pt_release(entry, level);
+    } else {
+      all_unmapped = false;
+    }
+
+    i += step;
+  }
+
+  vm_flush_range(start, npages);
+
+  return all_unmapped;
+}
+
+/**
+ * Share a run of pages from one address space into another without copying them. Writable pages
+ * become read-only copy-on-write pages in both address spaces. Neither address space may be
+ * running on another CPU.
+ * \param dst_root The physical address of the top-level page table receiving the pages
+ * \param src_root The physical address of the top-level page table the pages come from
+ * \param start The first virtual address to share, must be page-aligned
+ * \param npages The number of 4 KiB pages to share
+ * \returns true if every mapped page was shared, or false if memory ran out or a huge page was hit
+ */
+bool vm_share_range(uintptr_t dst_root, uintptr_t src_root, uintptr_t start, size_t npages) {
+
+  bool all_shared = true;
+
+  for (size_t i = 0; i < npages; i++) {
+    uintptr_t address = start + i * PAGE_SIZE;
+
+    int level;
+    pt_entry_t* src = vm_lookup(src_root, address, &level);
+
+    if (src == NULL) {
+      continue;
+    }
+
+    // Huge pages are never shared, and never replaced in the destination
+    if (level != 1) {
+      all_shared = false;
+      continue;
+    }
+
+    uintptr_t frame = (uintptr_t) src->address << 12;
+    int flags = (src->user ? VM_USER : 0) | ((src->writable || src->cow) ? VM_WRITABLE : 0) |
+                (src->no_execute ? 0 : VM_EXECUTABLE);
+
+    // From here on writes to the page in either address space copy it first
+    src->writable = 0;
+    src->cow = (flags & VM_WRITABLE) != 0;
+
+    pt_entry_t* old = vm_lookup(dst_root, address, &level);
+
+    if (old != NULL) {
+      if (level != 1) {
+        all_shared = false;
+        continue;
+      }
+
+      // Already shared, or mapping something else that this replaces
+      if (old->address == src->address) {
+        continue;
+      }
+      pt_release(old, 1);
+    }
+
+    pt_entry_t* dest = vm_walk_create(dst_root, address, 1);
+
+    if (dest == NULL) {
+      all_shared = false;
+      break;
+    }
+
+    // Build the new entry from scratch, so the source's accessed, dirty and global bits stay
+    // behind: a per-process mapping must never be global
+    pmem_ref(frame);
+    memset(dest, 0, sizeof(pt_entry_t));
+    dest->address = frame >> 12;
+    dest->present = 1;
+    dest->cow = src->cow;
+    pt_set_flags(dest, flags);
+  }
+
+  // The source lost write access and the destination may have lost old mappings. Flush whichever
+  // is loaded here, and have every CPU flush the PCIDs that cached either before using them again.
+  uintptr_t loaded = read_cr3() & ~(uintptr_t) CR3_PCID_MASK;
+  if (loaded == src_root || loaded == dst_root) {
+    vm_flush_range(start, npages);
+  }
+  sched_forget_tlb(src_root);
+  sched_forget_tlb(dst_root);
+
+  return all_shared;
+}
+
+/**
+ * Map a frame that is shared with other mappings. If flags asks for a writable page, the page is
+ * mapped read-only and copied on the first write.
+ * \param root The physical address of the top-level page table structure
+ * \param address The virtual address to map, must be page-aligned
+ * \param frame The physical address of the frame, which gains a reference
+ * \param flags A combination of VM_USER, VM_WRITABLE and VM_EXECUTABLE
+ * \returns true if the mapping succeeded, or false if there was an error
+ */
+bool vm_map_cow(uintptr_t root, uintptr_t address, uintptr_t frame, int flags) {
+
+  pt_entry_t* dest = vm_walk_create(root, address, 1);
+
+  if (dest == NULL) {
+    return false;
+  }
+
+  pmem_ref(frame);
+
+  dest->address = frame >> 12;
+  dest->present = 1;
+  dest->page_size = 0;
+  dest->cow = (flags & VM_WRITABLE) != 0;
+  pt_set_flags(dest, flags);
+
+  invalidate_tlb(address);
+
+  return true;
+}
+
+/**
+ * Handle a write to a copy-on-write page. The page is copied if it is still shared, or simply made
+ * writable if this is the last mapping of it.
+ * \param root The physical address of the top-level page table structure
+ * \param address The virtual address that was written
+ * \returns true if the page is now writable, or false if it is not a copy-on-write page
+ */
+bool vm_resolve_cow(uintptr_t root, uintptr_t address) {
+
+  int level;
+  pt_entry_t* entry = vm_lookup(root, address, &level);
+
+  if (entry == NULL || level != 1 || !entry->cow) {
+    return false;
+  }
+
+  uintptr_t frame = (uintptr_t) entry->address << 12;
+
+  if (pmem_refcount(frame) != 1) {
+    uintptr_t copy = pmem_alloc();
+
+    if (copy == 0) {
+      return false;
+    }
+
+    memcpy((void*) (copy + hhdm_base), (void*) (frame + hhdm_base), PAGE_SIZE);
+    entry->address = copy >> 12;
+    pmem_unref(frame);
+  }
+
+  entry->cow = 0;
+  entry->writable = 1;
+
+  invalidate_tlb(address & ~(uintptr_t) (PAGE_SIZE - 1));
+
+  return true;
+}
+
+// Unmap everything in the lower half of an address space with level 4 page table at address root
+void unmap_lower_half() {
+
+  uintptr_t root = get_top_table();
+
+  // We can reclaim memory used to hold page tables, but NOT the mapped pages
+  pt_entry_t* l4_table = (pt_entry_t*) ptov((void*) root);
+
+  for (size_t l4_index = 0; l4_index < 256; l4_index++) {
+
+    // kprint_f("the 4: %dth table at %p is present: %d\n", l4_index, l4_table[l4_index], l4_table[l4_index].present);
+
+    // Does this entry point to a level 3 table?
+    if (l4_table[l4_index].present) {
+
+      // Yes. Mark the entry as not present in the level 4 table
+      l4_table[l4_index].present = false;
+
+      // Now loop over the level 3 table
+      pt_entry_t* l3_table = (pt_entry_t*) ptov((void*) (l4_table[l4_index].address << 12));
+      for (size_t l3_index = 0; l3_index < 512; l3_index++) {
+
+
+        // Does this entry point to a level 2 table?
+        if (l3_table[l3_index].present && !l3_table[l3_index].page_size) {
+
+          // Yes. Loop over the level 2 table
+          pt_entry_t* l2_table = (pt_entry_t*) ptov((void*) (l3_table[l3_index].address << 12));
+          for (size_t l2_index = 0; l2_index < 512; l2_index++) {
+
+            // Does this entry point to a level 1 table?
+            if (l2_table[l2_index].present && !l2_table[l2_index].page_size) {
+
+              // Yes. Free the physical page the holds the level 1 table
+              pmem_free(l2_table[l2_index].address << 12);
+            }
+          }
+
+          // Free the physical page that held the level 2 table
+          pmem_free(l3_table[l3_index].address << 12);
+        }
+      }
+
+      // Free the physical page that held the level 3 table
+      pmem_free(l4_table[l4_index].address << 12);
+    }
+  }
+
+  // Move to a fresh TLB context so no stale user translations survive; kernel pages are global
+  // and stay cached
+  vm_new_tlb_context(root);
+}
+
+/**
+ * Create an empty user address space. The kernel's upper half is shared with every other address
+ * space by copying the top-level entries that point to its tables.
+ * \returns the physical address of the new top-level page table, or 0 if out of memory
+ */
+uintptr_t vm_create_address_space() {
+  uintptr_t root = pmem_alloc_zeroed();
+
+  if (root == 0) {
+    return 0;
+  }
+
+  pt_entry_t* kernel_table = (pt_entry_t*) ptov((void*) get_top_table());
+  pt_entry_t* table = (pt_entry_t*) ptov((void*) root);
+
+  for (size_t l4_index = 256; l4_index < 512; l4_index++) {
+    table[l4_index] = kernel_table[l4_index];
+  }
+
+  return root;
+}
+
+/**
+ * Free a user address space that is no longer loaded on any CPU: every page mapped in its lower
+ * half, the tables that held them and the top-level table itself. Shared and copy-on-write frames
+ * are only freed once their last reference is dropped.
+ * \param root The physical address of the top-level page table structure
+ */
+void vm_free_address_space(uintptr_t root) {
+  pt_entry_t* l4_table = (pt_entry_t*) ptov((void*) root);
+
+  for (size_t l4_index = 0; l4_index < 256; l4_index++) {
+    if (!l4_table[l4_index].present) {
+      continue;
+    }
+
+    uintptr_t l3_frame = (uintptr_t) l4_table[l4_index].address << 12;
+    pt_entry_t* l3_table = (pt_entry_t*) ptov((void*) l3_frame);
+
+    for (size_t l3_index = 0; l3_index < 512; l3_index++) {
+      pt_entry_t* l3 = &l3_table[l3_index];
+
+      if (!l3->present) {
+        continue;
+      } else if (l3->page_size) {
+        pt_release(l3, 3);
+        continue;
+      }
+
+      uintptr_t l2_frame = (uintptr_t) l3->address << 12;
+      pt_entry_t* l2_table = (pt_entry_t*) ptov((void*) l2_frame);
+
+      for (size_t l2_index = 0; l2_index < 512; l2_index++) {
+        pt_entry_t* l2 = &l2_table[l2_index];
+
+        if (!l2->present) {
+          continue;
+        } else if (l2->page_size) {
+          pt_release(l2, 2);
+          continue;
+        }
+
+        uintptr_t l1_frame = (uintptr_t) l2->address << 12;
+        pt_entry_t* l1_table = (pt_entry_t*) ptov((void*) l1_frame);
+
+        for (size_t l1_index = 0; l1_index < 512; l1_index++) {
+          if (l1_table[l1_index].present) {
+            pt_release(&l1_table[l1_index], 1);
+          }
+        }
+
+        pmem_free(l1_frame);
+      }
+
+      pmem_free(l2_frame);
+    }
+
+    pmem_free(l3_frame);
+  }
+
+  pmem_free(root);
+}
+
+// Mark every supervisor leaf mapping in the upper half of an address space global
+void vm_set_kernel_global(uintptr_t root) {
+  pt_entry_t* l4_table = (pt_entry_t*) ptov((void*) root);
+
+  for (size_t l4_index = 256; l4_index < 512; l4_index++) {
+    if (!l4_table[l4_index].present) {
+      continue;
+    }
+
+    pt_entry_t* l3_table = (pt_entry_t*) ptov((void*) ((uintptr_t) l4_table[l4_index].address << 12));
+    for (size_t l3_index = 0; l3_index < 512; l3_index++) {
+      pt_entry_t* l3 = &l3_table[l3_index];
+
+      if (!l3->present || l3->user) {
+        continue;
+      } else if (l3->page_size) {
+        l3->global = 1;
+        continue;
+      }
+
+      pt_entry_t* l2_table = (pt_entry_t*) ptov((void*) ((uintptr_t) l3->address << 12));
+      for (size_t l2_index = 0; l2_index < 512; l2_index++) {
+        pt_entry_t* l2 = &l2_table[l2_index];
+
+        if (!l2->present || l2->user) {
+          continue;
+        } else if (l2->page_size) {
+          l2->global = 1;
+          continue;
+        }
+
+        pt_entry_t* l1_table = (pt_entry_t*) ptov((void*) ((uintptr_t) l2->address << 12));
+        for (size_t l1_index = 0; l1_index < 512; l1_index++) {
+          if (l1_table[l1_index].present && !l1_table[l1_index].user) {
+            l1_table[l1_index].global = 1;
+          }
+        }
+      }
+    }
+  }
+}
+
+/**
+ * Make the kernel's upper-half mappings global so they survive address space switches, and turn on
+ * PCIDs if the CPU has them so switches need not flush other address spaces either.
+ */
+void tlb_setup() {
+  uint32_t eax, ebx, ecx, edx;
+  __asm__ volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1));
+
+  vm_set_kernel_global(get_top_table());
+
+  // PCIDE can only be turned on while CR3 holds PCID 0, which is true during boot
+  pcid_enabled = (ecx >> 17) & 1;
+  mem_cpu_init();
+
+  vm_flush_all();
+}
+
+// Flush every TLB entry, including global ones, by toggling CR4.PGE
+void vm_flush_all() {
+  uint64_t cr4 = read_cr4();
+  write_cr4(cr4 & ~(uint64_t) CR4_PGE);
+  write_cr4(cr4);
+}
+
+// Hand out the next PCID for a new address space
+uint16_t pcid_alloc() {
+  uint16_t pcid = next_pcid;
+
+  next_pcid = (next_pcid + 1 == MAX_PCID) ? 1 : next_pcid + 1;
+
+  return pcid;
+}
+
+/**
+ * Switch to an address space.
+ * \param root The physical address of the top-level page table structure
+ * \param pcid The PCID of the address space, ignored if PCIDs are off
+ * \param flush Drop any cached translations tagged with the PCID first. Needed when the PCID was
+ *              last used by a different address space.
+ */
+void vm_switch(uintptr_t root, uint16_t pcid, bool flush) {
+  if (!pcid_enabled) {
+    write_cr3(root);
+    return;
+  }
+
+  write_cr3(root | (pcid & CR3_PCID_MASK) | ((flush || !pcid_reuse) ? 0 : CR3_NOFLUSH));
+}
+
+/**
+ * Choose whether address space switches may keep the entries cached under the PCID they switch
+ * to. Turning this off gives up what PCIDs save without turning CR4.PCIDE off on every CPU.
+ * \param enabled Keep cached entries across switches when the PCID still belongs to the process
+ * \returns false if the CPU has no PCIDs, in which case every switch flushes regardless
+ */
+bool vm_set_pcid_reuse(bool enabled) {
+  pcid_reuse = enabled;
+  return pcid_enabled;
+}
+
+/**
+ * Start a new TLB context for an address space whose user mappings just changed wholesale. With
+ * PCIDs this tags it with a fresh PCID, leaving every other context's entries and all global
+ * entries cached. Without them, it reloads CR3, which still keeps global entries.
+ * \returns the PCID now in use, or 0 if PCIDs are off
+ */
+uint16_t vm_new_tlb_context(uintptr_t root) {
+  uint16_t pcid = pcid_enabled ? pcid_alloc() : 0;
+  vm_switch(root, pcid, true);
+  return pcid;
 }
\ No newline at end of file
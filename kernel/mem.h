@@ -6,16 +6,89 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#define PAGE_SIZE 0x1000
+#define PAGE_SIZE_2M 0x200000
+#define PAGE_SIZE_1G 0x40000000
+
+// The largest block the physical allocator hands out is 2^PMEM_MAX_ORDER pages (1 GiB)
+#define PMEM_MAX_ORDER 18
+
+// Protection flags for the range mapping functions
+#define VM_USER 0x1
+#define VM_WRITABLE 0x2
+#define VM_EXECUTABLE 0x4
+
+// Per-frame metadata kept by the physical allocator
+typedef struct page {
+  uint32_t refcount;  // number of mappings or owners holding the frame
+} page_t;
+
+// Counters for one CPU's cache of free pages
+typedef struct pmem_magazine_stats {
+  uint64_t allocs;   // pmem_alloc() calls
+  uint64_t frees;    // pmem_free() calls
+  uint64_t hits;     // allocations served without touching the buddy allocator
+  uint64_t refills;  // batches pulled from the buddy allocator
+  uint64_t spills;   // batches pushed back to the buddy allocator
+  uint64_t cached;   // pages currently held in the magazine
+} pmem_magazine_stats_t;
+
+// Counters for the pool of pre-zeroed frames
+typedef struct pmem_zero_pool_stats {
+  uint64_t hits;     // pmem_alloc_zeroed() calls served from the pool
+  uint64_t misses;   // pmem_alloc_zeroed() calls that had to zero a page inline
+  uint64_t cached;   // zeroed pages currently in the pool
+} pmem_zero_pool_stats_t;
+
+// How much physical memory the allocator manages
+typedef struct pmem_usage {
+  uint64_t total_pages;  // usable pages, not counting the allocator's own metadata
+  uint64_t free_pages;   // pages left in the buddy allocator
+} pmem_usage_t;
+
 void* memset(void* ptr, int c, size_t n);
 void* memcpy(void* dest, const void* src, size_t size);
+void* memmove(void* dest, const void* src, size_t size);
+int memcmp(const void* ptr1, const void* ptr2, size_t size);
+void mem_features_init();
 uint64_t get_hhdm_base();
 uintptr_t get_top_table();
 void initialize_memory(struct stivale2_struct_tag_memmap* physical_tag, struct stivale2_struct_tag_hhdm* virtual_tag);
 uintptr_t pmem_alloc();
 void pmem_free(uintptr_t p);
+uintptr_t pmem_alloc_pages(int order);
+void pmem_free_pages(uintptr_t p, int order);
+void pmem_get_magazine_stats(uint32_t cpu, pmem_magazine_stats_t* stats);
+void zero_page(void* page);
+uintptr_t pmem_alloc_zeroed();
+bool pmem_zero_pool_fill_one();
+void pmem_get_zero_pool_stats(pmem_zero_pool_stats_t* stats);
+void pmem_get_usage(pmem_usage_t* usage);
+void pmem_ref(uintptr_t p);
+void pmem_unref(uintptr_t p);
+void pmem_pin(uintptr_t p);
+uint32_t pmem_refcount(uintptr_t p);
 uintptr_t ptov(void* address);
 uintptr_t translate_virtual_to_physcial(void* address);
+bool vm_map_frame(uintptr_t root, uintptr_t address, uintptr_t frame, size_t page_size, int flags);
 bool vm_map(uintptr_t root, uintptr_t address, bool user, bool writable, bool executable);
+bool vm_map_huge(uintptr_t root, uintptr_t address, size_t page_size, bool user, bool writable, bool executable);
+bool vm_map_region(uintptr_t root, uintptr_t address, size_t length, bool user, bool writable, bool executable);
 bool vm_unmap(uintptr_t root, uintptr_t address);
 bool vm_protect(uintptr_t root, uintptr_t address, bool user, bool writable, bool executable);
-void unmap_lower_half();
\ No newline at end of file
+bool vm_map_range(uintptr_t root, uintptr_t start, size_t npages, int flags);
+bool vm_protect_range(uintptr_t root, uintptr_t start, size_t npages, int flags);
+bool vm_unmap_range(uintptr_t root, uintptr_t start, size_t npages);
+bool vm_share_range(uintptr_t dst_root, uintptr_t src_root, uintptr_t start, size_t npages);
+bool vm_map_cow(uintptr_t root, uintptr_t address, uintptr_t frame, int flags);
+bool vm_resolve_cow(uintptr_t root, uintptr_t address);
+void unmap_lower_half();
+uintptr_t vm_create_address_space();
+void vm_free_address_space(uintptr_t root);
+void tlb_setup();
+void mem_cpu_init();
+void vm_flush_all();
+uint16_t pcid_alloc();
+void vm_switch(uintptr_t root, uint16_t pcid, bool flush);
+bool vm_set_pcid_reuse(bool enabled);
+uint16_t vm_new_tlb_context(uintptr_t root);
\ No newline at end of file
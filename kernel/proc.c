@@ -0,0 +1,285 @@
+#include "proc.h"
+#include "sched.h"
+#include "kprint.h"
+#include "lock.h"
+#include "util.h"
+#include "vdso.h"
+
+// Number of callee-saved registers context_switch keeps on a switched-out stack
+#define CONTEXT_REGISTERS 6
+
+// Free slots are claimed under this lock; everything else about a process's state is covered by
+// the scheduler lock
+spinlock_t proc_table_lock;
+process_t processes[MAX_PROCESSES];
+uint32_t next_pid = 1;
+
+// Exited processes whose parent exited first, so nobody will wait for them. Protected by the
+// scheduler lock; idle CPUs free them with proc_reap_orphan().
+uint32_t orphan_zombies = 0;
+
+// The first code a new process runs, once switched to: load its program and enter user mode, or
+// run its kernel function
+void proc_entry() {
+  sched_switch_done();
+  irq_enable();
+
+  process_t* process = current_process;
+
+  if (process->image == NULL) {
+    process->kernel_entry(process->kernel_arg);
+    proc_exit(0);
+  }
+
+  exec(process->image);
+
+  // exec only returns if the program could not be loaded
+  proc_exit(-1);
+}
+
+// Take a free slot in the process table and give it a kernel stack that starts in proc_entry
+process_t* proc_alloc(process_t* parent) {
+
+  process_t* process = NULL;
+  size_t slot;
+
+  uintptr_t stack = pmem_alloc_pages(PROC_STACK_ORDER);
+
+  if (stack == 0) {
+    return NULL;
+  }
+
+  uint64_t flags = spin_lock_irqsave(&proc_table_lock);
+
+  for (slot = 0; slot < MAX_PROCESSES; slot++) {
+    if (processes[slot].state == PROC_UNUSED) {
+      process = &processes[slot];
+
+      // Hold the slot until the process is queued
+      process->state = PROC_WAITING;
+      process->pid = next_pid++;
+      break;
+    }
+  }
+
+  spin_unlock_irqrestore(&proc_table_lock, flags);
+
+  if (process == NULL) {
+    pmem_free_pages(stack, PROC_STACK_ORDER);
+    return NULL;
+  }
+
+  process->root = 0;
+  process->pcid = slot + 1;
+  process->last_cpu = cpu_id();
+  process->heap_next = USER_HEAP_BASE;
+  process->kernel_stack = ptov((void*) stack);
+  process->image = NULL;
+  process->kernel_entry = NULL;
+  process->kernel_arg = NULL;
+  process->parent = parent;
+  process->exit_status = 0;
+  process->on_cpu = false;
+  process->ring = NULL;
+  process->wait_queue = NULL;
+  process->wait_child = NULL;
+  region_clear(&process->space);
+
+  // Lay out the stack as if context_switch had switched away from just before proc_entry: the
+  // saved registers, then proc_entry as the return address, then a dummy return address for
+  // proc_entry itself so it starts with the stack aligned like any other function
+  uintptr_t* top = (uintptr_t*) (process->kernel_stack + PROC_STACK_SIZE);
+  *--top = 0;
+  *--top = (uintptr_t) proc_entry;
+  for (int i = 0; i < CONTEXT_REGISTERS; i++) {
+    *--top = 0;
+  }
+  process->kernel_rsp = (uintptr_t) top;
+
+  return process;
+}
+
+// Return a process's memory and its slot in the table. It must not be running.
+void proc_free(process_t* process) {
+  if (process->root != 0) {
+    sched_drop_address_space(process->root);
+    vm_free_address_space(process->root);
+  }
+  pmem_free_pages(process->kernel_stack - get_hhdm_base(), PROC_STACK_ORDER);
+  __atomic_store_n(&process->state, PROC_UNUSED, __ATOMIC_RELEASE);
+}
+
+process_t* proc_spawn(exec_image_t* image, process_t* parent) {
+
+  if (image == NULL) {
+    return NULL;
+  }
+
+  process_t* process = proc_alloc(parent);
+
+  if (process == NULL) {
+    return NULL;
+  }
+
+  process->root = vm_create_address_space();
+
+  if (process->root == 0 || !vdso_map(process->root)) {
+    proc_free(process);
+    return NULL;
+  }
+
+  process->image = image;
+  sched_enqueue(process);
+
+  return process;
+}
+
+process_t* proc_spawn_kernel(void (*entry)(void* arg), void* arg, process_t* parent) {
+
+  process_t* process = proc_alloc(parent);
+
+  if (process == NULL) {
+    return NULL;
+  }
+
+  process->kernel_entry = entry;
+  process->kernel_arg = arg;
+  sched_enqueue(process);
+
+  return process;
+}
+
+process_t* proc_find_child(uint32_t pid) {
+  process_t* process = NULL;
+
+  uint64_t flags = spin_lock_irqsave(&proc_table_lock);
+
+  for (size_t slot = 0; slot < MAX_PROCESSES; slot++) {
+    if (processes[slot].state != PROC_UNUSED && processes[slot].pid == pid &&
+        processes[slot].parent == current_process) {
+      process = &processes[slot];
+      break;
+    }
+  }
+
+  spin_unlock_irqrestore(&proc_table_lock, flags);
+
+  return process;
+}
+
+int proc_wait(process_t* child) {
+
+  // Other processes, including the child, run until it exits and wakes us. Checking and going to
+  // sleep under the scheduler lock means the child cannot exit in between and miss us.
+  while (true) {
+    uint64_t flags = sched_lock();
+
+    if (child->state == PROC_ZOMBIE) {
+      current_process->wait_child = NULL;
+      sched_unlock(flags);
+      break;
+    }
+
+    // Only this child's exit wakes us; a process asleep on a wait queue is left alone
+    current_process->wait_child = child;
+    current_process->state = PROC_WAITING;
+    schedule_locked(flags);
+  }
+
+  // The child's CPU may still be switching away from it, on its stack and in its address space
+  while (__atomic_load_n(&child->on_cpu, __ATOMIC_ACQUIRE)) {
+    __asm__ volatile("pause");
+  }
+
+  int status = child->exit_status;
+  proc_free(child);
+
+  return status;
+}
+
+// Leave the current process's children without a parent, counting the ones that have already
+// exited as orphans. The caller must hold the scheduler lock, which children read parent under.
+void proc_orphan_children(process_t* process) {
+  spin_lock(&proc_table_lock);
+
+  for (size_t slot = 0; slot < MAX_PROCESSES; slot++) {
+    process_t* child = &processes[slot];
+
+    if (child->state != PROC_UNUSED && child->parent == process) {
+      child->parent = NULL;
+      if (child->state == PROC_ZOMBIE) {
+        orphan_zombies++;
+      }
+    }
+  }
+
+  spin_unlock(&proc_table_lock);
+}
+
+bool proc_reap_orphan() {
+  if (__atomic_load_n(&orphan_zombies, __ATOMIC_RELAXED) == 0) {
+    return false;
+  }
+
+  process_t* orphan = NULL;
+  uint64_t flags = sched_lock();
+  spin_lock(&proc_table_lock);
+
+  for (size_t slot = 0; slot < MAX_PROCESSES; slot++) {
+    if (processes[slot].state == PROC_ZOMBIE && processes[slot].parent == NULL) {
+      orphan = &processes[slot];
+
+      // Hold the slot so no other CPU reaps it too
+      orphan->state = PROC_WAITING;
+      orphan_zombies--;
+      break;
+    }
+  }
+
+  spin_unlock(&proc_table_lock);
+  sched_unlock(flags);
+
+  if (orphan == NULL) {
+    return false;
+  }
+
+  while (__atomic_load_n(&orphan->on_cpu, __ATOMIC_ACQUIRE)) {
+    __asm__ volatile("pause");
+  }
+
+  proc_free(orphan);
+
+  return true;
+}
+
+void proc_exit(int status) {
+  process_t* process = current_process;
+
+  if (process->parent == NULL) {
+    kprint_f("process %d exited with status %d and nothing to return to\n", process->pid, status);
+  }
+
+  // The parent cannot free our stack until the switch away from us is complete and clears on_cpu
+  uint64_t flags = sched_lock();
+
+  proc_orphan_children(process);
+
+  process->exit_status = status;
+  process->state = PROC_ZOMBIE;
+
+  // Read under the scheduler lock, since the parent may be exiting at the same time
+  process_t* parent = process->parent;
+
+  if (parent == NULL) {
+    orphan_zombies++;
+  } else if (parent->state == PROC_WAITING && parent->wait_child == process) {
+    parent->wait_child = NULL;
+    sched_enqueue(parent);
+  }
+
+  // Our address space and stack stay intact until the parent frees them
+  schedule_locked(flags);
+
+  kprint_f("proc_exit: a dead process was resumed\n");
+  halt();
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include "mem.h"
+#include "region.h"
+#include "exec.h"
+#include "cpu.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// The most processes that can exist at once. A process's PCID is its slot in the table plus one.
+#define MAX_PROCESSES 64
+
+// Each process gets a kernel stack of 2^PROC_STACK_ORDER pages for its syscalls and interrupts
+#define PROC_STACK_ORDER 2
+#define PROC_STACK_SIZE (PAGE_SIZE << PROC_STACK_ORDER)
+
+// Where memmap starts handing out memory in a new process
+#define USER_HEAP_BASE 0x80000000000
+
+typedef enum proc_state {
+  PROC_UNUSED,
+  PROC_READY,     // Runnable, waiting for a CPU
+  PROC_RUNNING,
+  PROC_WAITING,   // Suspended until the child in wait_child exits, or a wait queue wakes it
+  PROC_ZOMBIE     // Exited, waiting for its parent to collect the status
+} proc_state_t;
+
+typedef struct process {
+  uint32_t pid;
+  proc_state_t state;
+  uintptr_t root;           // Physical address of the process's top-level page table
+  uint16_t pcid;
+  vm_space_t space;
+  uintptr_t heap_next;      // The next address memmap will hand out
+  uintptr_t kernel_stack;   // The lowest address of the kernel stack
+  uintptr_t kernel_rsp;     // The saved kernel stack pointer while switched out
+  exec_image_t* image;      // The program a user process runs, or NULL for a kernel process
+  void (*kernel_entry)(void* arg);
+  void* kernel_arg;
+  struct process* parent;
+  int exit_status;
+  struct process* run_next; // The next process in a CPU's wakeup inbox
+  struct process* wait_next; // The next process sleeping on the same wait queue
+  struct wait_queue* wait_queue; // The wait queue the process is linked on, or NULL
+  struct process* wait_child; // The child proc_wait is sleeping on, or NULL
+  uint32_t slice_left;      // Timer ticks left in the current time slice
+  uint32_t last_cpu;        // The CPU the process last ran on, where it is woken up again
+  volatile bool on_cpu;     // Set until a CPU has finished switching away from the process
+  struct ring* ring;        // The process's system call rings, through the HHDM, or NULL
+} process_t;
+
+// The process running on this CPU
+#define current_process ((process_t*) this_cpu()->current)
+
+/**
+ * Create a process that will run an executable in a fresh address space, and queue it to run.
+ * \param image The executable to run
+ * \param parent The process that will wait for it, or NULL
+ * \returns the new process, or NULL if the process table or memory is exhausted
+ */
+process_t* proc_spawn(exec_image_t* image, process_t* parent);
+
+/**
+ * Create a process that runs a function in the kernel, in whatever address space is loaded. It
+ * exits when the function returns.
+ * \param entry The function to run
+ * \param arg The argument passed to entry
+ * \param parent The process that will wait for it, or NULL
+ * \returns the new process, or NULL if the process table or memory is exhausted
+ */
+process_t* proc_spawn_kernel(void (*entry)(void* arg), void* arg, process_t* parent);
+
+/**
+ * Look up a child of the current process that has not been waited for yet.
+ * \param pid The child's process ID
+ * \returns the child, or NULL if the current process has no such child
+ */
+process_t* proc_find_child(uint32_t pid);
+
+/**
+ * Run a child of the current process until it exits, then free it.
+ * \param child A process spawned with the current process as its parent
+ * \returns the child's exit status
+ */
+int proc_wait(process_t* child);
+
+// End the current process and wake its parent. Its children are left without a parent, and
+// freed by proc_reap_orphan() once they exit. Never returns.
+void proc_exit(int status);
+
+/**
+ * Free one exited process that has no parent left to wait for it. Called by idle CPUs.
+ * \returns true if a process was freed, false if there was none
+ */
+bool proc_reap_orphan();
@@ -0,0 +1,145 @@
+#include "region.h"
+
+// Forget every region in an address space. The pages themselves are released with the page tables.
+void region_clear(vm_space_t* space) {
+  space->count = 0;
+}
+
+/**
+ * Reserve a range of virtual memory that will be backed with zeroed pages on first touch.
+ * \param space The address space to add the region to
+ * \param start The start of the region, must be page-aligned
+ * \param length The length of the region in bytes, rounded up to a whole number of pages
+ * \param flags A combination of VM_USER, VM_WRITABLE and VM_EXECUTABLE
+ * \returns true if the region was added, or false if the address space has no room for it
+ */
+bool region_reserve(vm_space_t* space, uintptr_t start, size_t length, int flags) {
+
+  if (start & (PAGE_SIZE - 1)) {
+    return false;
+  }
+
+  uintptr_t end = start + ((length + PAGE_SIZE - 1) & ~(size_t) (PAGE_SIZE - 1));
+
+  // Grow an existing region when the new one directly follows it, as heap reservations do
+  for (size_t i = 0; i < space->count; i++) {
+    vm_region_t* region = &space->regions[i];
+
+    if (region->end == start && region->flags == flags && region->limit == 0) {
+      region->end = end;
+      return true;
+    }
+  }
+
+  if (space->count == MAX_REGIONS) {
+    return false;
+  }
+
+  vm_region_t* region = &space->regions[space->count++];
+  region->start = start;
+  region->end = end;
+  region->flags = flags;
+  region->limit = 0;
+
+  return true;
+}
+
+/**
+ * Reserve a stack that ends at top. It starts out length bytes long and grows down on faults
+ * until it is max_length bytes long.
+ * \returns true if the region was added, or false if the address space has no room for it
+ */
+bool region_reserve_stack(vm_space_t* space, uintptr_t top, size_t length, size_t max_length, int flags) {
+
+  if (space->count == MAX_REGIONS || (top & (PAGE_SIZE - 1))) {
+    return false;
+  }
+
+  vm_region_t* region = &space->regions[space->count++];
+  region->start = top - ((length + PAGE_SIZE - 1) & ~(size_t) (PAGE_SIZE - 1));
+  region->end = top;
+  region->flags = flags;
+  region->limit = top - max_length;
+
+  return true;
+}
+
+// Find the region containing an address, growing a stack region down to cover it if possible
+vm_region_t* region_find(vm_space_t* space, uintptr_t address) {
+
+  for (size_t i = 0; i < space->count; i++) {
+    vm_region_t* region = &space->regions[i];
+
+    if (address >= region->start && address < region->end) {
+      return region;
+    }
+
+    if (region->limit != 0 && address >= region->limit && address < region->start) {
+      region->start = address & ~(uintptr_t) (PAGE_SIZE - 1);
+      return region;
+    }
+  }
+
+  return NULL;
+}
+
+bool vm_handle_fault(uintptr_t address, uint64_t error_code) {
+
+  uintptr_t root = get_top_table();
+
+  // Writes to present pages are only allowed if the page is copy-on-write
+  if ((error_code & PF_PRESENT) && (error_code & PF_WRITE)) {
+    return vm_resolve_cow(root, address);
+  }
+
+  vm_region_t* region = (current_space == NULL) ? NULL : region_find(current_space, address);
+
+  if (region == NULL) {
+    return false;
+  }
+
+  // Only missing pages are filled in; the access itself must be allowed by the region
+  if (error_code & PF_PRESENT) {
+    return false;
+  }
+
+  if ((error_code & PF_WRITE) && !(region->flags & VM_WRITABLE)) {
+    return false;
+  }
+
+  if ((error_code & PF_INSTRUCTION) && !(region->flags & VM_EXECUTABLE)) {
+    return false;
+  }
+
+  // Back the whole surrounding 2 MiB with a huge page when the region covers all of it
+  uintptr_t huge = address & ~(uintptr_t) (PAGE_SIZE_2M - 1);
+  if (region->limit == 0 && huge >= region->start && huge + PAGE_SIZE_2M <= region->end) {
+    uintptr_t frame = pmem_alloc_pages(9);
+
+    if (frame != 0) {
+      for (uintptr_t offset = 0; offset < PAGE_SIZE_2M; offset += PAGE_SIZE) {
+        zero_page((void*) ptov((void*) (frame + offset)));
+      }
+
+      if (vm_map_frame(root, huge, frame, PAGE_SIZE_2M, region->flags)) {
+        return true;
+      }
+
+      // Part of the 2 MiB is already mapped with normal pages
+      pmem_free_pages(frame, 9);
+    }
+  }
+
+  uintptr_t frame = pmem_alloc_zeroed();
+
+  if (frame == 0) {
+    return false;
+  }
+
+  if (!vm_map_frame(root, address & ~(uintptr_t) (PAGE_SIZE - 1), frame, PAGE_SIZE, region->flags)) {
+    pmem_free(frame);
+    return false;
+  }
+
+  return true;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "mem.h"
+#include "cpu.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// The most regions a single address space can hold
+#define MAX_REGIONS 32
+
+// Bits of the error code pushed for a page fault
+#define PF_PRESENT 0x1
+#define PF_WRITE 0x2
+#define PF_USER 0x4
+#define PF_INSTRUCTION 0x10
+
+// A range of user virtual memory whose pages are allocated and zero-filled on first touch
+typedef struct vm_region {
+  uintptr_t start;
+  uintptr_t end;
+  int flags;          // VM_USER, VM_WRITABLE and VM_EXECUTABLE
+  uintptr_t limit;    // lowest address a stack region may grow down to, or 0 if it never grows
+} vm_region_t;
+
+// The regions that make up the lazily-backed part of a user address space
+typedef struct vm_space {
+  vm_region_t regions[MAX_REGIONS];
+  size_t count;
+} vm_space_t;
+
+// The address space of the program running on this CPU, or NULL if it is a kernel process
+#define current_space (this_cpu()->space)
+
+void region_clear(vm_space_t* space);
+bool region_reserve(vm_space_t* space, uintptr_t start, size_t length, int flags);
+bool region_reserve_stack(vm_space_t* space, uintptr_t top, size_t length, size_t max_length, int flags);
+vm_region_t* region_find(vm_space_t* space, uintptr_t address);
+
+/**
+ * Resolve a page fault by copying a copy-on-write page that was written, or by backing the
+ * faulting page with a zeroed frame if the address falls in a region of the current address space
+ * and the access is allowed.
+ * \param address The faulting virtual address (from CR2)
+ * \param error_code The error code pushed by the processor
+ * \returns true if the fault was resolved and the access can be retried
+ */
+bool vm_handle_fault(uintptr_t address, uint64_t error_code);
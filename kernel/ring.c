@@ -0,0 +1,69 @@
+#include "ring.h"
+#include "proc.h"
+#include "syscallC.h"
+
+_Static_assert(sizeof(ring_t) <= PAGE_SIZE, "the rings must fit in one page");
+
+uintptr_t ring_setup() {
+  process_t* process = current_process;
+
+  if (process->ring != NULL) {
+    return USER_RING_BASE;
+  }
+
+  uintptr_t frame = pmem_alloc_zeroed();
+
+  if (frame == 0) {
+    return 0;
+  }
+
+  // Mapped up front, so it never faults and needs no region
+  if (!vm_map_frame(process->root, USER_RING_BASE, frame, PAGE_SIZE, VM_USER | VM_WRITABLE)) {
+    pmem_free(frame);
+    return 0;
+  }
+
+  process->ring = (ring_t*) ptov((void*) frame);
+
+  return USER_RING_BASE;
+}
+
+// Whether a system call can be made from the submission ring
+bool ring_call_allowed(uint32_t number) {
+  return number != SYS_EXIT && number != SYS_RING_SETUP && number != SYS_RING_ENTER;
+}
+
+uint64_t ring_drain() {
+  ring_t* ring = current_process->ring;
+
+  if (ring == NULL) {
+    return -1;
+  }
+
+  uint32_t sq_head = ring->sq_head;
+  uint32_t sq_tail = __atomic_load_n(&ring->sq_tail, __ATOMIC_ACQUIRE);
+  uint32_t cq_tail = ring->cq_tail;
+  uint64_t completed = 0;
+
+  // Never make more calls than fit in the ring, whatever the process wrote to sq_tail
+  while (sq_head != sq_tail && completed < RING_ENTRIES) {
+
+    if (cq_tail - __atomic_load_n(&ring->cq_head, __ATOMIC_ACQUIRE) >= RING_ENTRIES) {
+      break;
+    }
+
+    // Copy the request, so the process cannot change it while the call is made
+    ring_sqe_t sqe = ring->sq[sq_head % RING_ENTRIES];
+    uint64_t result = ring_call_allowed(sqe.number) ? syscall_dispatch(sqe.number, sqe.args) : -1;
+
+    ring_cqe_t* cqe = &ring->cq[cq_tail % RING_ENTRIES];
+    cqe->user_data = sqe.user_data;
+    cqe->result = result;
+
+    __atomic_store_n(&ring->cq_tail, ++cq_tail, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->sq_head, ++sq_head, __ATOMIC_RELEASE);
+    completed++;
+  }
+
+  return completed;
+}
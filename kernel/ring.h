@@ -0,0 +1,23 @@
+#pragma once
+
+#include "../stdlib/syscalls.h"
+
+#include <stdint.h>
+
+// Where a process's ring page is mapped, between its stack and the top of user space
+#define USER_RING_BASE 0x7F0000000000
+
+/**
+ * Give the current process a submission and completion ring, in a zeroed page shared with the
+ * kernel. The page is freed with the rest of the address space.
+ * \returns the user address of the ring_t, or 0 if memory is exhausted
+ */
+uintptr_t ring_setup();
+
+/**
+ * Make each call queued on the current process's submission ring, in order, and post the results
+ * on its completion ring. Stops early if the completion ring fills up; the remaining calls stay
+ * queued. exit and the ring calls themselves cannot be queued, and complete with -1.
+ * \returns the number of calls completed, or -1 if the process has no ring
+ */
+uint64_t ring_drain();
@@ -0,0 +1,437 @@
+#include "sched.h"
+#include "gdt.h"
+#include "lock.h"
+#include "util.h"
+
+// Each CPU's boot context, run whenever no other process is ready there
+process_t idle_processes[MAX_CPUS];
+
+// Size of each CPU's run queue. Every process can be queued on one CPU at once, so it never fills.
+#define RUN_QUEUE_SIZE MAX_PROCESSES
+
+// The ready processes of one CPU. Only the owner adds to the ring, at bottom; the owner and idle
+// CPUs stealing work both take from top with a compare-and-swap, so the owner runs its processes
+// in FIFO order and needs no lock. Other CPUs hand the owner processes they wake through the
+// inbox, a lock-free stack it empties into the ring whenever it schedules.
+typedef struct run_queue {
+  volatile uint64_t top;
+  volatile uint64_t bottom;
+  process_t* volatile slots[RUN_QUEUE_SIZE];
+  process_t* volatile inbox;
+  uint64_t rng;               // State for choosing which CPU to steal from
+} run_queue_t;
+
+run_queue_t run_queues[MAX_CPUS];
+
+// Protects process states, so a process can check something and go to sleep without a wakeup
+// slipping in between. The run queues do not need it, and it is never held across a switch.
+spinlock_t sched_spinlock;
+
+uint32_t sched_timeslice = SCHED_DEFAULT_SLICE;
+
+// The boot address space, which has no user mappings and is never freed
+uintptr_t kernel_root = 0;
+
+// The pid of the process each CPU last loaded each PCID for. Any other process using that PCID
+// on that CPU must flush it first.
+uint32_t pcid_owner[MAX_CPUS][MAX_PROCESSES + 1];
+
+// The address space each CPU last loaded under each PCID
+uintptr_t pcid_root[MAX_CPUS][MAX_PROCESSES + 1];
+
+sched_stats_t cpu_stats[MAX_CPUS];
+
+void context_switch(uintptr_t* save_rsp, uintptr_t rsp);
+
+bool is_idle_process(process_t* process) {
+  return process >= &idle_processes[0] && process < &idle_processes[MAX_CPUS];
+}
+
+void sched_init() {
+  kernel_root = get_top_table();
+  sched_init_cpu();
+}
+
+void sched_init_cpu() {
+  cpu_t* cpu = this_cpu();
+  process_t* idle = &idle_processes[cpu->id];
+
+  idle->pid = 0;
+  idle->state = PROC_RUNNING;
+  idle->root = 0;
+  idle->last_cpu = cpu->id;
+  idle->on_cpu = true;
+
+  // Any nonzero seed will do, as long as CPUs do not all pick the same victims
+  run_queues[cpu->id].rng = (rdtsc() << 8) | (cpu->id + 1);
+
+  cpu->idle = idle;
+  cpu->current = idle;
+  cpu->space = NULL;
+  cpu->loaded_root = get_top_table();
+}
+
+// Load the boot address space on this CPU
+void load_kernel_root(cpu_t* cpu) {
+  vm_switch(kernel_root, 0, false);
+  cpu->loaded_root = kernel_root;
+  cpu->drop_root = 0;
+}
+
+void sched_drop_address_space(uintptr_t root) {
+  for (uint32_t i = 0; i < cpu_count; i++) {
+    cpu_t* cpu = &cpus[i];
+
+    if (cpu == this_cpu()) {
+      uint64_t flags = irq_save();
+      if (cpu->loaded_root == root) {
+        load_kernel_root(cpu);
+      }
+      irq_restore(flags);
+      continue;
+    }
+
+    // Ask the other CPU to move off it at its next tick or idle loop pass
+    while (__atomic_load_n(&cpu->loaded_root, __ATOMIC_ACQUIRE) == root) {
+      cpu->drop_root = root;
+      __asm__ volatile("pause");
+    }
+  }
+}
+
+void sched_forget_tlb(uintptr_t root) {
+  for (uint32_t i = 0; i < cpu_count; i++) {
+    for (uint32_t pcid = 1; pcid <= MAX_PROCESSES; pcid++) {
+      if (pcid_root[i][pcid] == root) {
+        // No process has pid 0, so whoever loads this PCID next flushes it first
+        __atomic_store_n(&pcid_owner[i][pcid], 0, __ATOMIC_RELAXED);
+      }
+    }
+  }
+}
+
+// Honour another CPU's request to stop using an address space. Only kernel processes borrow one.
+void sched_check_drop(cpu_t* cpu) {
+  if (cpu->drop_root != 0 && cpu->drop_root == cpu->loaded_root && cpu->current->root == 0) {
+    load_kernel_root(cpu);
+  }
+}
+
+uint64_t sched_lock() {
+  return spin_lock_irqsave(&sched_spinlock);
+}
+
+void sched_unlock(uint64_t flags) {
+  spin_unlock_irqrestore(&sched_spinlock, flags);
+}
+
+// Add a process to the bottom of this CPU's run queue. Only the owning CPU may call this.
+void run_queue_push(run_queue_t* queue, process_t* process) {
+  uint64_t bottom = queue->bottom;
+
+  queue->slots[bottom % RUN_QUEUE_SIZE] = process;
+  __atomic_store_n(&queue->bottom, bottom + 1, __ATOMIC_RELEASE);
+}
+
+// Take the process at the top of a run queue, or NULL if it is empty. Any CPU may call this.
+process_t* run_queue_take(run_queue_t* queue) {
+  while (true) {
+    uint64_t top = __atomic_load_n(&queue->top, __ATOMIC_ACQUIRE);
+    uint64_t bottom = __atomic_load_n(&queue->bottom, __ATOMIC_ACQUIRE);
+
+    if (top >= bottom) {
+      return NULL;
+    }
+
+    // The slot cannot be reused before top moves past it, so it is safe to read before claiming
+    process_t* process = queue->slots[top % RUN_QUEUE_SIZE];
+
+    if (__atomic_compare_exchange_n(&queue->top, &top, top + 1, false, __ATOMIC_ACQ_REL,
+                                    __ATOMIC_ACQUIRE)) {
+      return process;
+    }
+  }
+}
+
+// Move the processes other CPUs woke for this one into its run queue, oldest first
+void run_queue_drain_inbox(run_queue_t* queue) {
+  process_t* list = __atomic_exchange_n(&queue->inbox, NULL, __ATOMIC_ACQUIRE);
+  process_t* reversed = NULL;
+
+  while (list != NULL) {
+    process_t* next = list->run_next;
+    list->run_next = reversed;
+    reversed = list;
+    list = next;
+  }
+
+  while (reversed != NULL) {
+    process_t* next = reversed->run_next;
+    run_queue_push(queue, reversed);
+    reversed = next;
+  }
+}
+
+void sched_enqueue(process_t* process) {
+  // Idle processes are never queued; each runs when its CPU has nothing else to do
+  if (is_idle_process(process)) {
+    process->state = PROC_READY;
+    return;
+  }
+
+  // Stay on this CPU until the process is queued, so the push below is to our own queue
+  uint64_t flags = irq_save();
+  cpu_t* cpu = this_cpu();
+
+  process->state = PROC_READY;
+
+  // Wake the process where it last ran, where its working set may still be cached
+  uint32_t target = process->last_cpu;
+  if (target >= cpu_count || !cpus[target].online) {
+    target = cpu->id;
+  }
+
+  if (target == cpu->id) {
+    run_queue_push(&run_queues[target], process);
+  } else {
+    run_queue_t* queue = &run_queues[target];
+    process_t* head = __atomic_load_n(&queue->inbox, __ATOMIC_RELAXED);
+
+    do {
+      process->run_next = head;
+    } while (!__atomic_compare_exchange_n(&queue->inbox, &head, process, true, __ATOMIC_RELEASE,
+                                          __ATOMIC_RELAXED));
+  }
+
+  irq_restore(flags);
+}
+
+// Steal a process from another CPU's run queue, starting with a randomly chosen one so idle
+// CPUs spread out over the busy ones instead of all contending for the same queue
+process_t* sched_steal(cpu_t* cpu) {
+  run_queue_t* own = &run_queues[cpu->id];
+
+  own->rng ^= own->rng << 13;
+  own->rng ^= own->rng >> 7;
+  own->rng ^= own->rng << 17;
+
+  uint32_t start = own->rng % cpu_count;
+
+  for (uint32_t i = 0; i < cpu_count; i++) {
+    uint32_t victim = (start + i) % cpu_count;
+
+    if (victim == cpu->id) {
+      continue;
+    }
+
+    process_t* process = run_queue_take(&run_queues[victim]);
+
+    if (process != NULL) {
+      cpu_stats[cpu->id].steals++;
+      return process;
+    }
+  }
+
+  return NULL;
+}
+
+// Whether this CPU has anything to run besides its idle process
+bool sched_work_available(cpu_t* cpu) {
+  for (uint32_t i = 0; i < cpu_count; i++) {
+    run_queue_t* queue = &run_queues[i];
+
+    if (queue->top < queue->bottom) {
+      return true;
+    }
+  }
+
+  return run_queues[cpu->id].inbox != NULL;
+}
+
+void sched_switch_done() {
+  cpu_t* cpu = this_cpu();
+  sched_stats_t* stats = &cpu_stats[cpu->id];
+  uint64_t cycles = rdtsc() - cpu->switch_start;
+
+  stats->total_cycles += cycles;
+  if (cycles > stats->max_cycles) {
+    stats->max_cycles = cycles;
+  }
+
+  // The previous process's registers are saved, so another CPU may now run it
+  __atomic_store_n(&cpu->prev->on_cpu, false, __ATOMIC_RELEASE);
+}
+
+void schedule_locked(uint64_t flags) {
+  // Interrupts stay disabled until the switch is over, so we cannot move CPUs in the meantime
+  spin_unlock(&sched_spinlock);
+
+  cpu_t* cpu = this_cpu();
+  process_t* prev = cpu->current;
+  run_queue_t* queue = &run_queues[cpu->id];
+  bool runnable = prev->state == PROC_RUNNING || prev == cpu->idle;
+
+  cpu->need_resched = false;
+
+  run_queue_drain_inbox(queue);
+  process_t* next = run_queue_take(queue);
+
+  // Only steal when we would otherwise go idle, so busy processes keep their CPUs
+  if (next == NULL && (!runnable || prev == cpu->idle)) {
+    next = sched_steal(cpu);
+  }
+
+  if (next == NULL) {
+    // Nothing else is ready. A running process keeps the CPU; a blocked one hands it to idle.
+    if (runnable) {
+      prev->state = PROC_RUNNING;
+      irq_restore(flags);
+      return;
+    }
+    next = cpu->idle;
+  }
+
+  if (next == prev) {
+    // Woken up again before we switched away, and taken back from our own queue
+    prev->state = PROC_RUNNING;
+    irq_restore(flags);
+    return;
+  }
+
+  // A process woken up since it blocked is already queued, possibly on another CPU, and one
+  // that is still running goes to the back of ours. Either way no other CPU runs it until
+  // sched_switch_done() clears on_cpu on the far side of the switch.
+  if (prev->state == PROC_RUNNING && prev != cpu->idle) {
+    prev->state = PROC_READY;
+    run_queue_push(queue, prev);
+  }
+
+  // A process taken from another CPU may still be in the middle of being switched away from
+  while (__atomic_load_n(&next->on_cpu, __ATOMIC_ACQUIRE)) {
+    __asm__ volatile("pause");
+  }
+
+  cpu->switch_start = rdtsc();
+
+  next->state = PROC_RUNNING;
+  next->on_cpu = true;
+  next->slice_left = sched_timeslice;
+  cpu->current = next;
+  cpu->prev = prev;
+
+  if (next->root != 0) {
+    cpu->space = &next->space;
+    gdt_set_kernel_stack(next->kernel_stack + PROC_STACK_SIZE);
+
+    // Only load CR3 when the address space changes, or when this CPU's TLB may hold stale
+    // translations for the PCID: it was last used by another process here, or the process has
+    // since run, and possibly changed its mappings, on another CPU
+    bool flush = pcid_owner[cpu->id][next->pcid] != next->pid || next->last_cpu != cpu->id;
+
+    if (next->root != cpu->loaded_root || flush) {
+      vm_switch(next->root, next->pcid, flush);
+      pcid_owner[cpu->id][next->pcid] = next->pid;
+      pcid_root[cpu->id][next->pcid] = next->root;
+      cpu->loaded_root = next->root;
+      cpu_stats[cpu->id].cr3_switches++;
+    }
+  } else {
+    // Kernel processes borrow whatever address space is loaded, unless it is about to be freed
+    cpu->space = NULL;
+
+    if (prev->state == PROC_ZOMBIE && cpu->loaded_root == prev->root) {
+      load_kernel_root(cpu);
+    }
+  }
+
+  next->last_cpu = cpu->id;
+  cpu_stats[cpu->id].switches++;
+
+  context_switch(&prev->kernel_rsp, next->kernel_rsp);
+
+  // Running again, possibly on another CPU, in whichever context switched back to this one
+  sched_switch_done();
+  irq_restore(flags);
+}
+
+void schedule() {
+  schedule_locked(sched_lock());
+}
+
+void sched_sleep(spinlock_t* lock, uint64_t flags) {
+  spin_lock(&sched_spinlock);
+  current_process->state = PROC_WAITING;
+  spin_unlock(lock);
+  schedule_locked(flags);
+}
+
+void sched_yield() {
+  schedule();
+}
+
+void sched_preempt_point() {
+  if (this_cpu()->need_resched) {
+    schedule();
+  }
+}
+
+void sched_tick(bool from_user) {
+  cpu_t* cpu = this_cpu();
+  process_t* process = cpu->current;
+
+  sched_check_drop(cpu);
+
+  // Make processes woken for this CPU visible to idle CPUs, which can steal from the run queue
+  // but not from the inbox
+  run_queue_drain_inbox(&run_queues[cpu->id]);
+
+  if (process == cpu->idle) {
+    cpu->need_resched = sched_work_available(cpu);
+  } else if (process->slice_left > 0 && --process->slice_left == 0) {
+    cpu->need_resched = true;
+  }
+
+  if (from_user && cpu->need_resched) {
+    cpu_stats[cpu->id].preemptions++;
+    schedule();
+  }
+}
+
+void sched_set_timeslice(uint32_t ticks) {
+  sched_timeslice = (ticks == 0) ? 1 : ticks;
+}
+
+void sched_get_stats(sched_stats_t* stats) {
+  stats->switches = 0;
+  stats->cr3_switches = 0;
+  stats->preemptions = 0;
+  stats->steals = 0;
+  stats->total_cycles = 0;
+  stats->max_cycles = 0;
+
+  for (uint32_t i = 0; i < cpu_count; i++) {
+    stats->switches += cpu_stats[i].switches;
+    stats->cr3_switches += cpu_stats[i].cr3_switches;
+    stats->preemptions += cpu_stats[i].preemptions;
+    stats->steals += cpu_stats[i].steals;
+    stats->total_cycles += cpu_stats[i].total_cycles;
+    if (cpu_stats[i].max_cycles > stats->max_cycles) {
+      stats->max_cycles = cpu_stats[i].max_cycles;
+    }
+  }
+}
+
+void sched_idle() {
+  while (true) {
+    cpu_t* cpu = this_cpu();
+
+    sched_check_drop(cpu);
+
+    if (sched_work_available(cpu)) {
+      schedule();
+    } else if (!proc_reap_orphan() && !pmem_zero_pool_fill_one()) {
+      // Nothing to run, reap or zero: sleep until the next interrupt
+      __asm__ volatile("hlt");
+    }
+  }
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include "proc.h"
+#include "lock.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Default time slice, in timer ticks
+#define SCHED_DEFAULT_SLICE 10
+
+// Counters describing the scheduler's context switches
+typedef struct sched_stats {
+  uint64_t switches;      // Context switches of any kind
+  uint64_t cr3_switches;  // Switches that had to load a different address space
+  uint64_t preemptions;   // Switches forced by an expired time slice
+  uint64_t steals;        // Processes an idle CPU took from another CPU's run queue
+  uint64_t total_cycles;  // Cycles from deciding to switch to running in the next context
+  uint64_t max_cycles;
+} sched_stats_t;
+
+// Set up scheduling on the bootstrap processor, turning the boot context into its idle process
+void sched_init();
+
+// Turn the calling CPU's boot context into its idle process, which runs whenever nothing else
+// is ready
+void sched_init_cpu();
+
+/**
+ * Make sure no CPU still has an address space loaded before it is freed. Only kernel processes
+ * borrow another process's address space, so this never waits for long.
+ * \param root The physical address of the top-level page table structure
+ */
+void sched_drop_address_space(uintptr_t root);
+
+/**
+ * Make every CPU flush the translations it cached for an address space under its PCID before
+ * loading it again, after its mappings changed while it was not loaded. No other CPU may be
+ * running in the address space at the time, since nothing reaches into its TLB.
+ * \param root The physical address of the top-level page table structure
+ */
+void sched_forget_tlb(uintptr_t root);
+
+/**
+ * Take the scheduler lock, which protects every process's state, with interrupts disabled.
+ * \returns the interrupt flags to pass to sched_unlock() or schedule_locked()
+ */
+uint64_t sched_lock();
+void sched_unlock(uint64_t flags);
+
+// Make a process runnable, queueing it on the CPU it last ran on. Safe with or without the
+// scheduler lock held.
+void sched_enqueue(process_t* process);
+
+/**
+ * Give the CPU to the next ready process: one woken for this CPU, then the oldest in its run
+ * queue, then, if the caller cannot keep running, one stolen from another CPU. A running caller
+ * goes to the back of this CPU's run queue and keeps the CPU if nothing else is ready; a caller
+ * that set itself PROC_WAITING or PROC_ZOMBIE first is not queued again.
+ */
+void schedule();
+
+/**
+ * schedule() for callers that hold the scheduler lock, so they can change their own state and
+ * switch away without a wakeup being missed in between. Returns with the lock released.
+ * \param flags The interrupt flags returned by sched_lock()
+ */
+void schedule_locked(uint64_t flags);
+
+/**
+ * Mark the current process PROC_WAITING, release a lock and switch away until something calls
+ * sched_enqueue() on it. Whoever wakes it must take the same lock to find it, so the wakeup
+ * cannot be missed.
+ * \param lock The lock, taken with spin_lock_irqsave()
+ * \param flags The interrupt flags returned by spin_lock_irqsave()
+ */
+void sched_sleep(spinlock_t* lock, uint64_t flags);
+
+// Give up the rest of the current time slice
+void sched_yield();
+
+// Yield if the current time slice has run out. Long-running kernel loops call this.
+void sched_preempt_point();
+
+// Account one timer tick, preempting the current process if its slice is over and it was
+// interrupted in user mode
+void sched_tick(bool from_user);
+
+// Must be the first thing a newly created process does when first switched to. Lets other CPUs
+// run the process that was switched away from.
+void sched_switch_done();
+
+// Set the number of timer ticks each process runs for before being preempted
+void sched_set_timeslice(uint32_t ticks);
+
+// Sum the context switch counters of every CPU
+void sched_get_stats(sched_stats_t* stats);
+
+// Run the idle loop on the calling CPU's boot stack. Never returns.
+void sched_idle();
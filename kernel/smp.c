@@ -0,0 +1,95 @@
+#include "smp.h"
+#include "cpu.h"
+#include "mem.h"
+#include "gdt.h"
+#include "exception.h"
+#include "syscallC.h"
+#include "lapic.h"
+#include "lock.h"
+#include "timer.h"
+#include "sched.h"
+#include "kprint.h"
+#include "util.h"
+
+// Each application processor starts on a stack of 2^AP_STACK_ORDER pages
+#define AP_STACK_ORDER 2
+
+// Give up on a processor that has not come online after this many cycles
+#define AP_START_TIMEOUT 1000000000UL
+
+// The address space application processors switch to; the bootloader's has no lower-half holes
+uintptr_t ap_root = 0;
+
+// Where application processors start, on the stack smp_init() gave them
+void ap_entry(struct stivale2_smp_info* info) {
+  vm_switch(ap_root, 0, true);
+
+  cpu_init(info->extra_argument, info->lapic_id);
+  mem_cpu_init();
+  gdt_setup();
+  idt_load();
+  syscall_cpu_init();
+  lapic_init();
+  lapic_timer_start(TIMER_HZ);
+  sched_init_cpu();
+
+  __atomic_store_n(&this_cpu()->online, true, __ATOMIC_RELEASE);
+
+  irq_enable();
+  sched_idle();
+}
+
+void smp_init(struct stivale2_struct_tag_smp* tag) {
+  cpu_t* bsp = this_cpu();
+
+  bsp->lapic_id = lapic_id();
+  bsp->online = true;
+
+  if (tag == NULL) {
+    return;
+  }
+
+  ap_root = get_top_table();
+
+  for (uint64_t i = 0; i < tag->cpu_count; i++) {
+    struct stivale2_smp_info* info = &tag->smp_info[i];
+
+    if (info->lapic_id == tag->bsp_lapic_id) {
+      continue;
+    }
+
+    if (cpu_count == MAX_CPUS) {
+      kprint_f("smp: only using %d cpus\n", MAX_CPUS);
+      break;
+    }
+
+    uintptr_t stack = pmem_alloc_pages(AP_STACK_ORDER);
+
+    if (stack == 0) {
+      kprint_f("smp: no memory for a stack for cpu %d\n", cpu_count);
+      break;
+    }
+
+    uint32_t id = cpu_count;
+    info->extra_argument = id;
+    info->target_stack = ptov((void*) stack) + (PAGE_SIZE << AP_STACK_ORDER);
+
+    // Writing the entry point starts the processor. One at a time, because gdt_setup() builds
+    // each CPU's GDT through a shared pointer.
+    __atomic_store_n(&info->goto_address, (uintptr_t) ap_entry, __ATOMIC_RELEASE);
+
+    uint64_t start = rdtsc();
+    while (!__atomic_load_n(&cpus[id].online, __ATOMIC_ACQUIRE) && rdtsc() - start < AP_START_TIMEOUT) {
+      __asm__ volatile("pause");
+    }
+
+    if (!cpus[id].online) {
+      kprint_f("smp: cpu %d (lapic %d) did not start\n", id, info->lapic_id);
+      break;
+    }
+
+    cpu_count++;
+  }
+
+  kprint_f("smp: %d cpus online\n", cpu_count);
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include "stivale2.h"
+
+/**
+ * Start every application processor the bootloader found. Each sets up its own GDT, TSS, GS base
+ * and local APIC timer, then joins the scheduler in its idle loop. Runs on the bootstrap
+ * processor after lapic_init() and lapic_timer_calibrate().
+ * \param tag The SMP tag from the bootloader, or NULL to stay on the bootstrap processor alone
+ */
+void smp_init(struct stivale2_struct_tag_smp* tag);
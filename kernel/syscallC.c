@@ -1,10 +1,38 @@
 #include "syscallC.h"
+#include "util.h"
+#include "../stdlib/syscalls.h"
 
-#define SYS_WRITE 0
-#define SYS_READ 1
-#define SYS_MMAP 2
-#define SYS_EXEC 3
-#define SYS_EXIT 4
+// Model-specific registers that configure the syscall instruction
+#define MSR_EFER 0xC0000080
+#define MSR_STAR 0xC0000081
+#define MSR_LSTAR 0xC0000082
+#define MSR_SFMASK 0xC0000084
+
+// EFER bit that enables syscall/sysret
+#define EFER_SCE 0x1
+
+// Flags cleared on entry through syscall: TF, IF, DF and AC, so the entry stub starts with
+// interrupts off until it is on the kernel stack, and the kernel's rep string instructions run
+// forwards whatever DF the program left set
+#define SYSCALL_FLAGS_MASK 0x40700
+
+// Whether a buffer passed to a system call lies entirely in user space, so the kernel cannot be
+// made to read or overwrite its own memory through it
+bool user_range_ok(const void* ptr, size_t size) {
+  uintptr_t start = (uintptr_t) ptr;
+  return start < USER_SPACE_END && size <= USER_SPACE_END - start;
+}
+
+// Whether a string passed to a system call, including its terminator, lies entirely in user space
+bool user_string_ok(const char* str) {
+  for (uintptr_t address = (uintptr_t) str; address < USER_SPACE_END; address++) {
+    if (*(const char*) address == '\0') {
+      return true;
+    }
+  }
+
+  return false;
+}
 
 // syscall 0: reads from keyboard input to buf
 size_t syscall_read(int fd, void* buf, size_t count) {
@@ -51,70 +79,265 @@ size_t syscall_write(int fd, void *buf, size_t count) {
   return count;
 }
 
-// starting malloc pointer
-uint64_t malloc_pointer = 0x80000000000;;
-
 // syscall 2: returns a malloc'ed pointer
-uint64_t syscall_memmap(uintptr_t address, bool user, bool writable, bool executable, size_t length) {
+uint64_t syscall_mmap(uintptr_t address, bool user, bool writable, bool executable, size_t length) {
+
+  // Always hand out whole pages, and keep large regions 2 MiB aligned so they can use huge pages
+  length = (length + PAGE_SIZE - 1) & ~(size_t) (PAGE_SIZE - 1);
+  if (length >= PAGE_SIZE_2M) {
+    current_process->heap_next = (current_process->heap_next + PAGE_SIZE_2M - 1) & ~(uint64_t) (PAGE_SIZE_2M - 1);
+  }
 
-  bool res = vm_map(get_top_table(), malloc_pointer, user, writable, executable);
+  // Only reserve the memory here; pages are backed by the page fault handler on first touch
+  int flags = (user ? VM_USER : 0) | (writable ? VM_WRITABLE : 0) | (executable ? VM_EXECUTABLE : 0);
+  bool res = region_reserve(current_space, current_process->heap_next, length, flags);
 
   if (res) {
-    uint64_t allocated_address = malloc_pointer;
-    // bump malloc_pointer
-    malloc_pointer += 0x1000 * (length / 4096);
+    uint64_t allocated_address = current_process->heap_next;
+    // bump the process's heap pointer
+    current_process->heap_next += length;
     return allocated_address;
   } 
 
   return 0x0;
 }
 
-// syscall 3: executes the module with the specified name
+// syscall 3: runs the module with the specified name as a child process and waits for it
 uint64_t syscall_exec(char* module_name) {
 
-  uint64_t elf_address = locate_module(module_name);
+  if (!user_string_ok(module_name)) {
+    return 1;
+  }
+
+  exec_image_t* image = exec_find(module_name);
 
-  if (elf_address == -1) {
+  if (image == NULL) {
     kprint_f("the specified program was not found\n");
     return 1;
   }
 
-  exec(elf_address);
+  process_t* child = proc_spawn(image, current_process);
 
-  return 0;
+  if (child == NULL) {
+    kprint_f("could not create a process for %s\n", module_name);
+    return 1;
+  }
+
+  // The caller stays suspended here until the child exits
+  return proc_wait(child);
 }
 
-// syscall 4: jumps back the shell, this be broken unfortunately :(
-uint64_t syscall_exit() {
-  uint64_t shell_elf = locate_module("shell");
-  exec(shell_elf);
+// syscall 4: ends the calling process and resumes the one that started it
+uint64_t syscall_exit(int status) {
+  proc_exit(status);
   return 0;
 }
 
+// syscall 5: starts the module with the specified name as a child process without waiting for it
+uint64_t syscall_spawn(char* module_name) {
+
+  if (!user_string_ok(module_name)) {
+    return -1;
+  }
+
+  exec_image_t* image = exec_find(module_name);
+
+  if (image == NULL) {
+    return -1;
+  }
+
+  process_t* child = proc_spawn(image, current_process);
+
+  if (child == NULL) {
+    return -1;
+  }
+
+  return child->pid;
+}
+
+// syscall 6: waits for a child started with spawn to exit and returns its status
+uint64_t syscall_wait(uint32_t pid) {
+
+  process_t* child = proc_find_child(pid);
+
+  if (child == NULL) {
+    return -1;
+  }
+
+  return proc_wait(child);
+}
+
+// syscall 8: maps a submission and completion ring into the calling process
+uint64_t syscall_ring_setup() {
+  return ring_setup();
+}
+
+// syscall 9: makes every call queued on the calling process's submission ring
+uint64_t syscall_ring_enter() {
+  return ring_drain();
+}
+
 // No more arguments than 6!
 uint64_t syscall(uint64_t num, ...);
 void syscall_entry();
+void syscall_fast_entry();
+
+// Check each syscall_<name> against its declaration in syscalls.def
+#define SYSCALL0(constant, number, ret, name) ret syscall_##name();
+#define SYSCALL1(constant, number, ret, name, t0, a0) ret syscall_##name(t0 a0);
+#define SYSCALL2(constant, number, ret, name, t0, a0, t1, a1) ret syscall_##name(t0 a0, t1 a1);
+#define SYSCALL3(constant, number, ret, name, t0, a0, t1, a1, t2, a2) \
+  ret syscall_##name(t0 a0, t1 a1, t2 a2);
+#define SYSCALL4(constant, number, ret, name, t0, a0, t1, a1, t2, a2, t3, a3) \
+  ret syscall_##name(t0 a0, t1 a1, t2 a2, t3 a3);
+#define SYSCALL5(constant, number, ret, name, t0, a0, t1, a1, t2, a2, t3, a3, t4, a4) \
+  ret syscall_##name(t0 a0, t1 a1, t2 a2, t3 a3, t4 a4);
+#include "../stdlib/syscalls.def"
+#undef SYSCALL0
+#undef SYSCALL1
+#undef SYSCALL2
+#undef SYSCALL3
+#undef SYSCALL4
+#undef SYSCALL5
+
+// Unpack the raw argument registers into each call's parameter types
+#define SYSCALL0(constant, number, ret, name) \
+  uint64_t dispatch_##name(uint64_t* args) { return (uint64_t) syscall_##name(); }
+#define SYSCALL1(constant, number, ret, name, t0, a0) \
+  uint64_t dispatch_##name(uint64_t* args) { return (uint64_t) syscall_##name((t0) args[0]); }
+#define SYSCALL2(constant, number, ret, name, t0, a0, t1, a1) \
+  uint64_t dispatch_##name(uint64_t* args) { \
+    return (uint64_t) syscall_##name((t0) args[0], (t1) args[1]); \
+  }
+#define SYSCALL3(constant, number, ret, name, t0, a0, t1, a1, t2, a2) \
+  uint64_t dispatch_##name(uint64_t* args) { \
+    return (uint64_t) syscall_##name((t0) args[0], (t1) args[1], (t2) args[2]); \
+  }
+#define SYSCALL4(constant, number, ret, name, t0, a0, t1, a1, t2, a2, t3, a3) \
+  uint64_t dispatch_##name(uint64_t* args) { \
+    return (uint64_t) syscall_##name((t0) args[0], (t1) args[1], (t2) args[2], (t3) args[3]); \
+  }
+#define SYSCALL5(constant, number, ret, name, t0, a0, t1, a1, t2, a2, t3, a3, t4, a4) \
+  uint64_t dispatch_##name(uint64_t* args) { \
+    return (uint64_t) syscall_##name((t0) args[0], (t1) args[1], (t2) args[2], (t3) args[3], \
+                                     (t4) args[4]); \
+  }
+#include "../stdlib/syscalls.def"
+#undef SYSCALL0
+#undef SYSCALL1
+#undef SYSCALL2
+#undef SYSCALL3
+#undef SYSCALL4
+#undef SYSCALL5
+
+typedef struct syscall_table_entry {
+  const char* name;
+  uint64_t (*dispatch)(uint64_t* args);
+} syscall_table_entry_t;
+
+#define SYSCALL0(constant, number, ret, name) [constant] = { #name, dispatch_##name },
+#define SYSCALL1(constant, number, ret, name, ...) [constant] = { #name, dispatch_##name },
+#define SYSCALL2(constant, number, ret, name, ...) [constant] = { #name, dispatch_##name },
+#define SYSCALL3(constant, number, ret, name, ...) [constant] = { #name, dispatch_##name },
+#define SYSCALL4(constant, number, ret, name, ...) [constant] = { #name, dispatch_##name },
+#define SYSCALL5(constant, number, ret, name, ...) [constant] = { #name, dispatch_##name },
+syscall_table_entry_t syscall_table[SYSCALL_COUNT] = {
+#include "../stdlib/syscalls.def"
+};
+#undef SYSCALL0
+#undef SYSCALL1
+#undef SYSCALL2
+#undef SYSCALL3
+#undef SYSCALL4
+#undef SYSCALL5
+
+// What has been counted for each system call. Updated atomically, since calls run on every CPU.
+typedef struct syscall_counters {
+  uint64_t count;
+  uint64_t total_cycles;
+  uint64_t histogram[SYSCALL_HISTOGRAM_BUCKETS];
+} syscall_counters_t;
+
+syscall_counters_t syscall_counters[SYSCALL_COUNT];
+
+// syscall 7: copies what has been counted for one system call to the caller
+uint64_t syscall_stats(uint32_t number, syscall_stats_t* stats) {
+
+  if (number >= SYSCALL_COUNT || !user_range_ok(stats, sizeof(syscall_stats_t))) {
+    return -1;
+  }
+
+  syscall_counters_t* counters = &syscall_counters[number];
+  const char* name = syscall_table[number].name;
+  size_t i;
+
+  for (i = 0; name[i] != '\0' && i < SYSCALL_NAME_SIZE - 1; i++) {
+    stats->name[i] = name[i];
+  }
+  stats->name[i] = '\0';
+
+  stats->count = __atomic_load_n(&counters->count, __ATOMIC_RELAXED);
+  stats->total_cycles = __atomic_load_n(&counters->total_cycles, __ATOMIC_RELAXED);
+  for (i = 0; i < SYSCALL_HISTOGRAM_BUCKETS; i++) {
+    stats->histogram[i] = __atomic_load_n(&counters->histogram[i], __ATOMIC_RELAXED);
+  }
+
+  return 0;
+}
+
+uint64_t syscall_dispatch(uint64_t num, uint64_t* args) {
+
+  if (num >= SYSCALL_COUNT) {
+    return -1;
+  }
+
+  syscall_counters_t* counters = &syscall_counters[num];
+
+  // Count the call up front, since exit never returns
+  __atomic_fetch_add(&counters->count, 1, __ATOMIC_RELAXED);
+
+  uint64_t start = rdtsc();
+  uint64_t result = syscall_table[num].dispatch(args);
+  uint64_t cycles = rdtsc() - start;
+
+  // Bucket i holds calls that took 2^i to 2^(i+1) cycles; the last one also holds anything longer
+  size_t bucket = (cycles == 0) ? 0 : 63 - __builtin_clzll(cycles);
+  if (bucket >= SYSCALL_HISTOGRAM_BUCKETS) {
+    bucket = SYSCALL_HISTOGRAM_BUCKETS - 1;
+  }
+
+  __atomic_fetch_add(&counters->total_cycles, cycles, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&counters->histogram[bucket], 1, __ATOMIC_RELAXED);
+
+  return result;
+}
 
 uint64_t syscall_handler(uint64_t num, uint64_t arg0, uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4, uint64_t arg5) {
 
-  switch (num) {
-    case 0:
-      return syscall_write(arg0, (void*) arg1, arg2);
-    case 1:
-      return syscall_read(arg0, (void*) arg1, arg2);
-    case 2:
-      return syscall_memmap(arg0, arg1, arg2, arg3, arg4);
-    case 3:
-      return syscall_exec((char*) arg0);
-    case 4:
-      return syscall_exit();
-    default:
-      kprint_f("you've called a syscall that doesn't exist!!\n");
-  }
-
-  return num;
+  if (num >= SYSCALL_COUNT) {
+    kprint_f("you've called a syscall that doesn't exist!!\n");
+    return num;
+  }
+
+  uint64_t args[6] = {arg0, arg1, arg2, arg3, arg4, arg5};
+
+  return syscall_dispatch(num, args);
 }
 
 void syscall_setup() {
-    idt_set_handler(0x80, syscall_entry, IDT_TYPE_TRAP);
+    // int $0x80 stays available for programs built before the syscall instruction was supported.
+    // It is an interrupt gate so no interrupt lands before syscall_entry has switched GS base.
+    idt_set_handler(0x80, syscall_entry, IDT_TYPE_INTERRUPT);
+    syscall_cpu_init();
+}
+
+void syscall_cpu_init() {
+    // syscall loads CS from STAR[47:32] and SS from the selector after it; sysret loads SS from
+    // STAR[63:48] + 8 and CS from STAR[63:48] + 16, both with RPL 3
+    uint64_t star = ((uint64_t) (KERNEL_DATA_SELECTOR | 0x3) << 48) | ((uint64_t) KERNEL_CODE_SELECTOR << 32);
+
+    wrmsr(MSR_STAR, star);
+    wrmsr(MSR_LSTAR, (uintptr_t) syscall_fast_entry);
+    wrmsr(MSR_SFMASK, SYSCALL_FLAGS_MASK);
+    wrmsr(MSR_EFER, rdmsr(MSR_EFER) | EFER_SCE);
 }
\ No newline at end of file
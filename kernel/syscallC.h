@@ -5,9 +5,25 @@
 #include "keyboard.h"
 #include "exception.h"
 #include "exec.h"
+#include "region.h"
+#include "proc.h"
+#include "gdt.h"
+#include "ring.h"
 
 #include "stddef.h"
 #include "stdint.h"
 #include "stdbool.h"
 
-void syscall_setup();
\ No newline at end of file
+// Install the int $0x80 handler and enable the syscall instruction on the bootstrap processor
+void syscall_setup();
+
+// Enable the syscall instruction on the calling CPU. Needs the CPU's GDT loaded first.
+void syscall_cpu_init();
+
+/**
+ * Make a system call on behalf of the current process, counting it in the statistics.
+ * \param num The system call number
+ * \param args The six argument registers
+ * \returns the call's result, or -1 if there is no such call
+ */
+uint64_t syscall_dispatch(uint64_t num, uint64_t* args);
\ No newline at end of file
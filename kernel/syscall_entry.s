@@ -2,6 +2,14 @@
 .global syscall_handler
 
 syscall_entry:
+    # switch to the kernel's GS base, which points at this CPU's data. The gate keeps interrupts
+    # off until then, since an interrupt handler would see a kernel CS and skip its own swapgs
+    swapgs
+    sti
+
+    # the kernel's string instructions assume DF is clear, and a user program may have set it
+    cld
+
     # put the 7th param on the stack
     push %rax
 
@@ -11,5 +19,64 @@ syscall_entry:
     # remove the stack head
     add $0x8, %rsp
 
+    # the process may have moved to another CPU while in the kernel, so swap back on
+    # whichever CPU it returns from. Nothing may interrupt between here and iretq, which
+    # restores the user's interrupt flag.
+    cli
+    swapgs
+
     # return from the int handler
-    iretq
\ No newline at end of file
+    iretq
+
+.global syscall_fast_entry
+
+# Entered by the syscall instruction with interrupts masked, the user's return address in %rcx,
+# its flags in %r11 and its stack pointer still in %rsp. Arguments arrive as for syscall_entry,
+# except that arg2 is in %r10 since the instruction overwrites %rcx.
+syscall_fast_entry:
+    # switch to this CPU's data, then to the running process's kernel stack
+    swapgs
+    mov %rsp, %gs:16
+    mov %gs:8, %rsp
+
+    # save what sysret needs on the kernel stack, since the process may change CPUs in the kernel
+    pushq %gs:16
+    push %rcx
+    push %r11
+
+    # move arg2 back to where the C calling convention expects it
+    mov %r10, %rcx
+
+    # put the 7th param on the stack
+    push %rax
+
+    # from here on the kernel stack and GS base are in place, so interrupts are safe. DF needs
+    # no cld here: SFMASK clears it on the way in, along with IF.
+    sti
+
+    # call the C-land syscall handler
+    call syscall_handler
+
+    # a syscall in the last bytes of user space returns to a non-canonical address, and sysret
+    # would then fault in ring 0 with the user's stack already loaded. A return there would fault
+    # in user mode anyway, so end the process instead.
+    mov 16(%rsp), %r10
+    shr $47, %r10
+    jnz syscall_bad_return
+
+    # nothing may interrupt between restoring the user stack and sysret
+    cli
+
+    # remove the stack head, then restore the user's flags, return address and stack
+    add $0x8, %rsp
+    pop %r11
+    pop %rcx
+    pop %rsp
+
+    swapgs
+
+    sysretq
+
+syscall_bad_return:
+    mov $-1, %edi
+    call proc_exit
@@ -0,0 +1,71 @@
+#include "timer.h"
+#include "pic.h"
+#include "port.h"
+#include "exception.h"
+#include "sched.h"
+#include "cpu.h"
+#include "vdso.h"
+#include "util.h"
+
+// The PIT's input clock and the ports for channel 0
+#define PIT_FREQUENCY 1193182
+#define PIT_CHANNEL0 0x40
+#define PIT_COMMAND 0x43
+
+// Channel 0, low byte then high byte, rate generator
+#define PIT_MODE_RATE 0x34
+
+// PIT ticks to count the TSC over when calibrating it
+#define TSC_CALIBRATE_TICKS 50
+
+volatile uint64_t timer_ticks = 0;
+uint64_t tsc_frequency = 0;
+
+__attribute__((interrupt))
+void timer_handler(interrupt_context_t* ctx) {
+  bool from_user = (ctx->cs & 3) == 3;
+
+  if (from_user) {
+    swapgs();
+  }
+
+  timer_ticks++;
+  vdso_tick();
+
+  // Acknowledge first: the tick may switch to another process before this handler returns
+  outb(PIC1_COMMAND, PIC_EOI);
+
+  // Only user code is preempted here; kernel code yields at its own preemption points
+  sched_tick(from_user);
+
+  if (from_user) {
+    swapgs();
+  }
+}
+
+void timer_setup(uint32_t hz) {
+  uint32_t divisor = PIT_FREQUENCY / hz;
+
+  outb(PIT_COMMAND, PIT_MODE_RATE);
+  outb(PIT_CHANNEL0, divisor & 0xFF);
+  outb(PIT_CHANNEL0, (divisor >> 8) & 0xFF);
+
+  idt_set_handler(IRQ0_INTERRUPT, timer_handler, IDT_TYPE_INTERRUPT);
+  pic_unmask_irq(0);
+}
+
+void timer_calibrate_tsc() {
+  // Start on a tick boundary, then count TSC cycles over a whole number of PIT ticks
+  uint64_t start = timer_ticks;
+  while (timer_ticks == start) {
+    __asm__ volatile("pause");
+  }
+
+  uint64_t tsc_start = rdtsc();
+  start = timer_ticks;
+  while (timer_ticks - start < TSC_CALIBRATE_TICKS) {
+    __asm__ volatile("pause");
+  }
+
+  tsc_frequency = (rdtsc() - tsc_start) * TIMER_HZ / TSC_CALIBRATE_TICKS;
+}
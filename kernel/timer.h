@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdint.h>
+
+// How often the timer interrupt fires
+#define TIMER_HZ 1000
+
+// Number of timer interrupts since timer_setup()
+extern volatile uint64_t timer_ticks;
+
+// TSC cycles per second, once timer_calibrate_tsc() has run
+extern uint64_t tsc_frequency;
+
+/**
+ * Program the PIT to interrupt at the given rate and hand every tick to the scheduler.
+ * \param hz The number of interrupts per second
+ */
+void timer_setup(uint32_t hz);
+
+// Measure the TSC frequency against the PIT. Needs the timer running and interrupts enabled.
+void timer_calibrate_tsc();
@@ -5,7 +5,6 @@ usermode_entry:
   mov %di, %ds
   mov %di, %es
   mov %di, %fs
-  mov %di, %gs
 
   # Push the stack segment selector (in first argument)
   push %rdi
@@ -30,5 +29,11 @@ usermode_entry:
   mov 64(%rsp), %r8
   mov 72(%rsp), %r9
 
+  # Leave the kernel's GS base behind for the next entry from user mode. An interrupt after
+  # swapgs would see a kernel CS and use the user GS base, so mask them until iretq restores the
+  # flags pushed above.
+  cli
+  swapgs
+
   # Use iret to jump away
   iretq
@@ -1,8 +1,18 @@
 #pragma once
 
+#include <stdint.h>
+
 // Halt the CPU in an infinite loop
-static void halt() {
+static inline void halt() {
   while (1) {
     __asm__("hlt");
   }
 }
+
+// Read the CPU's time-stamp counter
+static inline uint64_t rdtsc() {
+  uint32_t low;
+  uint32_t high;
+  __asm__ volatile("rdtsc" : "=a"(low), "=d"(high));
+  return ((uint64_t) high << 32) | low;
+}
@@ -0,0 +1,77 @@
+#include "vdso.h"
+#include "mem.h"
+#include "cpu.h"
+#include "timer.h"
+#include "util.h"
+
+_Static_assert(sizeof(vdso_data_t) <= PAGE_SIZE, "the kernel data page must fit in one page");
+_Static_assert(VDSO_MAX_CPUS >= MAX_CPUS, "the kernel data page needs a tick counter per CPU");
+
+uintptr_t vdso_frame = 0;
+vdso_data_t* vdso = NULL;
+
+// Move the time base up to now, so readers only ever scale a short TSC interval
+void vdso_update_time(uint64_t now) {
+  vdso->base_ns += ((now - vdso->base_tsc) * vdso->ns_mult) >> VDSO_NS_SHIFT;
+  vdso->base_tsc = now;
+}
+
+// Copy in everything else readers check seq for
+void vdso_update_stats() {
+  pmem_usage_t usage;
+  pmem_get_usage(&usage);
+
+  vdso->cpu_count = cpu_count;
+  vdso->timer_ticks = timer_ticks;
+  vdso->total_pages = usage.total_pages;
+  vdso->free_pages = usage.free_pages;
+}
+
+void vdso_init() {
+  vdso_frame = pmem_alloc_zeroed();
+
+  if (vdso_frame == 0) {
+    return;
+  }
+
+  timer_calibrate_tsc();
+
+  // The kernel keeps the page's first reference for good; each mapping takes another
+  vdso = (vdso_data_t*) ptov((void*) vdso_frame);
+  vdso->tsc_frequency = tsc_frequency;
+  vdso->timer_hz = TIMER_HZ;
+  vdso->ns_mult = ((uint64_t) 1000000000 << VDSO_NS_SHIFT) / tsc_frequency;
+  vdso->base_tsc = rdtsc();
+  vdso->base_ns = 0;
+  vdso_update_stats();
+}
+
+bool vdso_map(uintptr_t root) {
+  if (vdso_frame == 0) {
+    return true;
+  }
+
+  return vm_map_cow(root, VDSO_BASE, vdso_frame, VM_USER);
+}
+
+void vdso_tick() {
+  if (vdso == NULL) {
+    return;
+  }
+
+  cpu_t* cpu = this_cpu();
+  vdso->cpu_ticks[cpu->id]++;
+
+  // Only the bootstrap processor writes the rest, so the seqlock needs no writer lock
+  if (cpu->id != 0) {
+    return;
+  }
+
+  __atomic_store_n(&vdso->seq, vdso->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  vdso_update_time(rdtsc());
+  vdso_update_stats();
+
+  __atomic_store_n(&vdso->seq, vdso->seq + 1, __ATOMIC_RELEASE);
+}
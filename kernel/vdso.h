@@ -0,0 +1,21 @@
+#pragma once
+
+#include "../stdlib/vdso.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Set up the kernel data page. Needs the timer running and interrupts enabled, to calibrate the
+// TSC against it.
+void vdso_init();
+
+/**
+ * Map the kernel data page read-only into an address space at VDSO_BASE.
+ * \param root The physical address of the top-level page table structure
+ * \returns true if the mapping succeeded, or false if page tables could not be allocated
+ */
+bool vdso_map(uintptr_t root);
+
+// Account one timer interrupt on the calling CPU. The bootstrap processor also refreshes the time
+// base and memory statistics.
+void vdso_tick();
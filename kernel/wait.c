@@ -0,0 +1,92 @@
+#include "wait.h"
+#include "sched.h"
+
+uint64_t wait_queue_lock(wait_queue_t* queue) {
+  return spin_lock_irqsave(&queue->lock);
+}
+
+void wait_queue_unlock(wait_queue_t* queue, uint64_t flags) {
+  spin_unlock_irqrestore(&queue->lock, flags);
+}
+
+// Take a process off a wait queue's list wherever it is. The caller must hold the queue's lock.
+void wait_queue_remove(wait_queue_t* queue, process_t* process) {
+  process_t* prev = NULL;
+  process_t* current = queue->head;
+
+  while (current != NULL && current != process) {
+    prev = current;
+    current = current->wait_next;
+  }
+
+  if (current == NULL) {
+    return;
+  }
+
+  if (prev == NULL) {
+    queue->head = process->wait_next;
+  } else {
+    prev->wait_next = process->wait_next;
+  }
+  if (queue->tail == process) {
+    queue->tail = prev;
+  }
+
+  process->wait_next = NULL;
+  process->wait_queue = NULL;
+}
+
+void wait_queue_sleep(wait_queue_t* queue, uint64_t flags) {
+  process_t* process = current_process;
+
+  process->wait_next = NULL;
+  process->wait_queue = queue;
+  if (queue->tail == NULL) {
+    queue->head = process;
+  } else {
+    queue->tail->wait_next = process;
+  }
+  queue->tail = process;
+
+  // A waker needs the queue lock to find us, so it cannot make us ready before we are marked
+  // waiting. If it does so between here and the switch, schedule_locked() sees we are already
+  // queued to run again.
+  sched_sleep(&queue->lock, flags);
+
+  // Wakers take us off the list, but if anything else made us ready we are still on it, and a
+  // second sleep would link us in twice
+  if (__atomic_load_n(&process->wait_queue, __ATOMIC_RELAXED) != NULL) {
+    flags = wait_queue_lock(queue);
+    wait_queue_remove(queue, process);
+    wait_queue_unlock(queue, flags);
+  }
+}
+
+void wait_queue_wake_one_locked(wait_queue_t* queue) {
+  process_t* process = queue->head;
+
+  if (process == NULL) {
+    return;
+  }
+
+  queue->head = process->wait_next;
+  if (queue->head == NULL) {
+    queue->tail = NULL;
+  }
+  process->wait_next = NULL;
+  process->wait_queue = NULL;
+
+  sched_enqueue(process);
+}
+
+void wait_queue_wake_all_locked(wait_queue_t* queue) {
+  while (queue->head != NULL) {
+    wait_queue_wake_one_locked(queue);
+  }
+}
+
+void wait_queue_wake_all(wait_queue_t* queue) {
+  uint64_t flags = wait_queue_lock(queue);
+  wait_queue_wake_all_locked(queue);
+  wait_queue_unlock(queue, flags);
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "proc.h"
+#include "lock.h"
+
+// Processes sleeping until some event happens. Zero-initialized means empty.
+typedef struct wait_queue {
+  spinlock_t lock;    // Protects the list and whatever condition the sleepers are waiting on
+  process_t* head;
+  process_t* tail;
+} wait_queue_t;
+
+/**
+ * Take a wait queue's lock with interrupts disabled, so the condition can be checked without a
+ * wakeup slipping in before the process goes to sleep.
+ * \returns the interrupt flags to pass to wait_queue_unlock() or wait_queue_sleep()
+ */
+uint64_t wait_queue_lock(wait_queue_t* queue);
+void wait_queue_unlock(wait_queue_t* queue, uint64_t flags);
+
+/**
+ * Put the current process to sleep on a wait queue until it is woken up. The idle process must
+ * never sleep. Returns with the lock released; the caller should take it again and re-check its
+ * condition, since another process may have got there first.
+ * \param queue The wait queue, locked with wait_queue_lock()
+ * \param flags The interrupt flags returned by wait_queue_lock()
+ */
+void wait_queue_sleep(wait_queue_t* queue, uint64_t flags);
+
+// Wake the process that has been sleeping on a wait queue longest, if any. Callers may already
+// hold the queue's lock, as interrupt handlers that just changed the condition do.
+void wait_queue_wake_one_locked(wait_queue_t* queue);
+
+// Wake every process sleeping on a wait queue. Callers must hold the queue's lock.
+void wait_queue_wake_all_locked(wait_queue_t* queue);
+
+// Wake every process sleeping on a wait queue, taking its lock. Safe from interrupt handlers.
+void wait_queue_wake_all(wait_queue_t* queue);
@@ -1,3 +1,4 @@
 #!/bin/bash
 
-qemu-system-x86_64 -m 2G -curses -cdrom boot.iso
+# Set SMP to the number of virtual CPUs to boot with, e.g. SMP=4 ./run.sh
+qemu-system-x86_64 -m 2G -smp "${SMP:-1}" -curses -cdrom boot.iso
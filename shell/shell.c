@@ -6,9 +6,16 @@
 #include "stdmem.h"
 #include "stdexec.h"
 #include "stdstring.h"
+#include "stdsys.h"
+#include "stdtime.h"
+
+// The most instances the bench command starts at once
+#define BENCH_MAX_INSTANCES 32
 
 void runShell();
 void parseLine(char* cmd);
+void runBench(char* module_name, int instances);
+void printSyscallStats();
 
 void _start() {
   runShell();
@@ -40,6 +47,107 @@ void runShell() {
   }
 }
 
+static inline uint64_t rdtsc() {
+  uint32_t low;
+  uint32_t high;
+  __asm__ volatile("rdtsc" : "=a"(low), "=d"(high));
+  return ((uint64_t) high << 32) | low;
+}
+
+int parseNumber(char* str) {
+  int value = 0;
+
+  while (*str >= '0' && *str <= '9') {
+    value = value * 10 + (*str - '0');
+    str++;
+  }
+
+  return value;
+}
+
+// Run several instances of a module at once and report how long they took together. Run with
+// different numbers of CPUs to see how the scheduler scales.
+void runBench(char* module_name, int instances) {
+
+  int pids[BENCH_MAX_INSTANCES];
+
+  if (instances < 1 || instances > BENCH_MAX_INSTANCES) {
+    printf("bench: the instance count must be between 1 and %d\n", BENCH_MAX_INSTANCES);
+    return;
+  }
+
+  uint64_t start = rdtsc();
+  int started = 0;
+
+  while (started < instances) {
+    int pid = spawn(module_name);
+
+    if (pid < 0) {
+      printf("bench: could not start %s\n", module_name);
+      break;
+    }
+
+    pids[started++] = pid;
+  }
+
+  for (int i = 0; i < started; i++) {
+    wait(pids[i]);
+  }
+
+  uint64_t cycles = rdtsc() - start;
+
+  if (started == 0) {
+    return;
+  }
+
+  // Throughput in instances per billion cycles, to three decimal places
+  uint64_t throughput = (uint64_t) started * 1000000000000ull / cycles;
+
+  printf("%d instances of %s finished in %d cycles\n", started, module_name, cycles);
+  printf("throughput: %d.%d%d%d instances per billion cycles\n", throughput / 1000,
+         throughput / 100 % 10, throughput / 10 % 10, throughput % 10);
+}
+
+// Print how often each system call has been made and how long they took
+void printSyscallStats() {
+
+  syscall_stats_t stats;
+
+  for (uint32_t number = 0; sys_stats(number, &stats) == 0; number++) {
+    if (stats.count == 0) {
+      continue;
+    }
+
+    printf("%s: %d calls, %d cycles average\n", stats.name, stats.count,
+           stats.total_cycles / stats.count);
+
+    for (int bucket = 0; bucket < SYSCALL_HISTOGRAM_BUCKETS; bucket++) {
+      if (stats.histogram[bucket] != 0) {
+        printf("  %d+ cycles: %d\n", (uint64_t) 1 << bucket, stats.histogram[bucket]);
+      }
+    }
+  }
+}
+
+// Print the uptime, per-CPU timer ticks and memory use, all read from the kernel's data page
+void printUptime() {
+
+  struct timespec now;
+  uint64_t total_pages;
+  uint64_t free_pages;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  printf("up %d.%d%d%d seconds\n", now.tv_sec, now.tv_nsec / 100000000,
+         now.tv_nsec / 10000000 % 10, now.tv_nsec / 1000000 % 10);
+
+  for (uint32_t cpu = 0; cpu < cpus_online(); cpu++) {
+    printf("cpu %d: %d ticks\n", cpu, cpu_ticks(cpu));
+  }
+
+  memory_usage(&total_pages, &free_pages);
+  printf("memory: %d of %d pages free\n", free_pages, total_pages);
+}
+
 void parseLine(char* cmd) {
 
   int MAX_ARGS = 3;
@@ -52,14 +160,28 @@ void parseLine(char* cmd) {
   char* ptr = strtok_r(cmd, " \n\0", &saveptr);
 
   // split line into args 
-  while (ptr != NULL) {
+  while (ptr != NULL && i <= MAX_ARGS) {
     args[i++] = ptr;
     ptr = strtok_r(NULL, " \n\0", &saveptr);
   }
 
+  if (i == 0) {
+    printf("\n");
+    return;
+  }
+
   if (strcmp(args[0], "exec") == 0) {
     printf("\n");
     exec(args[1]);
+  } else if (strcmp(args[0], "stats") == 0) {
+    printf("\n");
+    printSyscallStats();
+  } else if (strcmp(args[0], "uptime") == 0) {
+    printf("\n");
+    printUptime();
+  } else if (strcmp(args[0], "bench") == 0 && i == 3) {
+    printf("\n");
+    runBench(args[1], parseNumber(args[2]));
   } else {
     printf("\nunrecognized command: %s\n", args[0]);
   }
@@ -0,0 +1,24 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "stdio.h"
+
+// Rounds of busy work each instance does before exiting. Touches no memory beyond the stack, so
+// instances on different CPUs only compete for CPU time.
+#define SPIN_ROUNDS 100000000
+
+void _start() {
+
+  volatile uint64_t state = 88172645463325252ull;
+
+  for (uint64_t i = 0; i < SPIN_ROUNDS; i++) {
+    uint64_t x = state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    state = x;
+  }
+
+  exit();
+}
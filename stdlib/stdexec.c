@@ -1,9 +1,14 @@
 #include "stdexec.h"
+#include "stdsys.h"
 
-#define SYS_EXEC 3
+int exec(char* module_name) {
+    return (int) sys_exec(module_name);
+}
 
-uint64_t syscall(uint64_t num, ...);
+int spawn(char* module_name) {
+    return (int) sys_spawn(module_name);
+}
 
-int exec(char* module_name) {
-    return (int) syscall(SYS_EXEC, module_name);
+int wait(int pid) {
+    return (int) sys_wait(pid);
 }
\ No newline at end of file
@@ -2,4 +2,11 @@
 
 #include "stdint.h"
 
-int exec(char* module_name);
\ No newline at end of file
+int exec(char* module_name);
+
+// Start a module as a child process without waiting for it. Returns its pid, or -1.
+int spawn(char* module_name);
+
+// Wait for a child started with spawn to exit. Returns its exit status, or -1 if pid is not a
+// child of the caller.
+int wait(int pid);
\ No newline at end of file
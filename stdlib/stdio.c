@@ -1,23 +1,18 @@
 #include "stdio.h"
-
-#define SYS_WRITE 0
-#define SYS_READ 1
-#define SYS_EXIT 4
-
-uint64_t syscall(uint64_t num, ...);
+#include "stdsys.h"
 
 uint64_t exit() {
-  return syscall(SYS_EXIT, 0);
+  return sys_exit(0);
 }
 
 // read (a wrapper around the syscall invocation
 size_t read(int fd, void* buf, size_t count) {
-    return syscall(SYS_READ, fd, buf, count);
+    return sys_read(fd, buf, count);
 }
 
 // write (a wrapper around the syscall invocation)
 size_t write(int fd, void *buf, size_t count) {
-    return syscall(SYS_WRITE, fd, buf, count);
+    return sys_write(fd, buf, count);
 }
 
 size_t strlen(const char* str) {
@@ -1,7 +1,7 @@
 #include "stdmem.h"
 #include "stdio.h"
+#include "stdsys.h"
 
-#define SYS_MMAP 2
 #define ROUND_UP(x, y) ((x) % (y) == 0 ? (x) : (x) + ((y) - (x) % (y)))
 #define PAGE_SIZE 0x1000
 
@@ -31,7 +31,7 @@ void* memcpy(void* dest, const void* src, size_t size) {
 
 
 void* mmap(void* addr, size_t length, int prot, int flags, int fd, int offset) {
-  return (void*) syscall(SYS_MMAP, NULL, 1, 1, 0, length);
+  return (void*) sys_mmap(0, true, true, false, length);
 }
 
 void* bump = NULL;
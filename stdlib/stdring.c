@@ -0,0 +1,48 @@
+#include "stdring.h"
+#include "stdsys.h"
+
+ring_t* ring_setup() {
+  return (ring_t*) sys_ring_setup();
+}
+
+bool ring_queue(ring_t* ring, uint32_t number, uint64_t args[6], uint64_t user_data) {
+  uint32_t tail = ring->sq_tail;
+
+  if (tail - __atomic_load_n(&ring->sq_head, __ATOMIC_ACQUIRE) >= RING_ENTRIES) {
+    return false;
+  }
+
+  ring_sqe_t* sqe = &ring->sq[tail % RING_ENTRIES];
+  sqe->number = number;
+  for (int i = 0; i < 6; i++) {
+    sqe->args[i] = args[i];
+  }
+  sqe->user_data = user_data;
+
+  // Publish the request only once it is filled in
+  __atomic_store_n(&ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+  return true;
+}
+
+bool ring_queue_write(ring_t* ring, int fd, void* buf, size_t count, uint64_t user_data) {
+  uint64_t args[6] = {(uint64_t) fd, (uint64_t) buf, count, 0, 0, 0};
+  return ring_queue(ring, SYS_WRITE, args, user_data);
+}
+
+uint64_t ring_submit(ring_t* ring) {
+  return sys_ring_enter();
+}
+
+bool ring_reap(ring_t* ring, ring_cqe_t* cqe) {
+  uint32_t head = ring->cq_head;
+
+  if (head == __atomic_load_n(&ring->cq_tail, __ATOMIC_ACQUIRE)) {
+    return false;
+  }
+
+  *cqe = ring->cq[head % RING_ENTRIES];
+  __atomic_store_n(&ring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+  return true;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "stdbool.h"
+#include "stdint.h"
+#include "syscalls.h"
+
+// Map this process's submission and completion rings. Returns NULL if they could not be set up.
+ring_t* ring_setup();
+
+// Queue a system call on the submission ring. Returns false if the ring is full.
+bool ring_queue(ring_t* ring, uint32_t number, uint64_t args[6], uint64_t user_data);
+
+// Queue a write on the submission ring. buf must stay valid until the write completes.
+bool ring_queue_write(ring_t* ring, int fd, void* buf, size_t count, uint64_t user_data);
+
+// Make every queued call with a single kernel entry. Returns the number of calls completed.
+uint64_t ring_submit(ring_t* ring);
+
+// Take the oldest completion off the completion ring. Returns false if there is none.
+bool ring_reap(ring_t* ring, ring_cqe_t* cqe);
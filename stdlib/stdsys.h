@@ -0,0 +1,123 @@
+#pragma once
+
+#include "syscalls.h"
+
+// Enter the kernel with a system call number and up to six arguments. Kept for callers that pick
+// the call at run time; sys_<name>() and syscall0() to syscall6() below inline the entry instead.
+uint64_t syscall(uint64_t num, ...);
+
+// syscall() through the slower int $0x80 path, kept for comparison
+uint64_t syscall_int80(uint64_t num, ...);
+
+// Inline system call entry, one per argument count. The kernel takes the number in %rdi, the
+// arguments in %rsi, %rdx, %r10, %r8, %r9 and %rax, and returns the result in %rax. The syscall
+// instruction overwrites %rcx and %r11, and the kernel's C handler may change any of the other
+// argument registers, so every one of them is an output or a clobber.
+
+static inline uint64_t syscall0(uint64_t num) {
+  uint64_t ret;
+  __asm__ volatile("syscall"
+                   : "=a"(ret), "+D"(num)
+                   :
+                   : "rsi", "rdx", "r10", "r8", "r9", "rcx", "r11", "memory");
+  return ret;
+}
+
+static inline uint64_t syscall1(uint64_t num, uint64_t a0) {
+  uint64_t ret;
+  __asm__ volatile("syscall"
+                   : "=a"(ret), "+D"(num), "+S"(a0)
+                   :
+                   : "rdx", "r10", "r8", "r9", "rcx", "r11", "memory");
+  return ret;
+}
+
+static inline uint64_t syscall2(uint64_t num, uint64_t a0, uint64_t a1) {
+  uint64_t ret;
+  __asm__ volatile("syscall"
+                   : "=a"(ret), "+D"(num), "+S"(a0), "+d"(a1)
+                   :
+                   : "r10", "r8", "r9", "rcx", "r11", "memory");
+  return ret;
+}
+
+static inline uint64_t syscall3(uint64_t num, uint64_t a0, uint64_t a1, uint64_t a2) {
+  register uint64_t r10 __asm__("r10") = a2;
+  uint64_t ret;
+  __asm__ volatile("syscall"
+                   : "=a"(ret), "+D"(num), "+S"(a0), "+d"(a1), "+r"(r10)
+                   :
+                   : "r8", "r9", "rcx", "r11", "memory");
+  return ret;
+}
+
+static inline uint64_t syscall4(uint64_t num, uint64_t a0, uint64_t a1, uint64_t a2, uint64_t a3) {
+  register uint64_t r10 __asm__("r10") = a2;
+  register uint64_t r8 __asm__("r8") = a3;
+  uint64_t ret;
+  __asm__ volatile("syscall"
+                   : "=a"(ret), "+D"(num), "+S"(a0), "+d"(a1), "+r"(r10), "+r"(r8)
+                   :
+                   : "r9", "rcx", "r11", "memory");
+  return ret;
+}
+
+static inline uint64_t syscall5(uint64_t num, uint64_t a0, uint64_t a1, uint64_t a2, uint64_t a3,
+                                uint64_t a4) {
+  register uint64_t r10 __asm__("r10") = a2;
+  register uint64_t r8 __asm__("r8") = a3;
+  register uint64_t r9 __asm__("r9") = a4;
+  uint64_t ret;
+  __asm__ volatile("syscall"
+                   : "=a"(ret), "+D"(num), "+S"(a0), "+d"(a1), "+r"(r10), "+r"(r8), "+r"(r9)
+                   :
+                   : "rcx", "r11", "memory");
+  return ret;
+}
+
+static inline uint64_t syscall6(uint64_t num, uint64_t a0, uint64_t a1, uint64_t a2, uint64_t a3,
+                                uint64_t a4, uint64_t a5) {
+  register uint64_t r10 __asm__("r10") = a2;
+  register uint64_t r8 __asm__("r8") = a3;
+  register uint64_t r9 __asm__("r9") = a4;
+  uint64_t ret = a5;
+  __asm__ volatile("syscall"
+                   : "+a"(ret), "+D"(num), "+S"(a0), "+d"(a1), "+r"(r10), "+r"(r8), "+r"(r9)
+                   :
+                   : "rcx", "r11", "memory");
+  return ret;
+}
+
+// Widen an argument to a full register, so the kernel never sees stale upper bits
+#define SYSCALL_ARG(arg) ((uint64_t) (arg))
+
+// sys_write(), sys_read(), ...: one typed inline stub for each system call in syscalls.def
+#define SYSCALL0(constant, number, ret, name) \
+  static inline ret sys_##name() { return (ret) syscall0(constant); }
+#define SYSCALL1(constant, number, ret, name, t0, a0) \
+  static inline ret sys_##name(t0 a0) { return (ret) syscall1(constant, SYSCALL_ARG(a0)); }
+#define SYSCALL2(constant, number, ret, name, t0, a0, t1, a1) \
+  static inline ret sys_##name(t0 a0, t1 a1) { \
+    return (ret) syscall2(constant, SYSCALL_ARG(a0), SYSCALL_ARG(a1)); \
+  }
+#define SYSCALL3(constant, number, ret, name, t0, a0, t1, a1, t2, a2) \
+  static inline ret sys_##name(t0 a0, t1 a1, t2 a2) { \
+    return (ret) syscall3(constant, SYSCALL_ARG(a0), SYSCALL_ARG(a1), SYSCALL_ARG(a2)); \
+  }
+#define SYSCALL4(constant, number, ret, name, t0, a0, t1, a1, t2, a2, t3, a3) \
+  static inline ret sys_##name(t0 a0, t1 a1, t2 a2, t3 a3) { \
+    return (ret) syscall4(constant, SYSCALL_ARG(a0), SYSCALL_ARG(a1), SYSCALL_ARG(a2), \
+                          SYSCALL_ARG(a3)); \
+  }
+#define SYSCALL5(constant, number, ret, name, t0, a0, t1, a1, t2, a2, t3, a3, t4, a4) \
+  static inline ret sys_##name(t0 a0, t1 a1, t2 a2, t3 a3, t4 a4) { \
+    return (ret) syscall5(constant, SYSCALL_ARG(a0), SYSCALL_ARG(a1), SYSCALL_ARG(a2), \
+                          SYSCALL_ARG(a3), SYSCALL_ARG(a4)); \
+  }
+#include "syscalls.def"
+#undef SYSCALL0
+#undef SYSCALL1
+#undef SYSCALL2
+#undef SYSCALL3
+#undef SYSCALL4
+#undef SYSCALL5
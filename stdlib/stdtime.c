@@ -0,0 +1,113 @@
+#include "stdtime.h"
+
+#define NS_PER_SEC 1000000000
+
+// The kernel's data page, mapped read-only into every process
+#define vdso ((const vdso_data_t*) VDSO_BASE)
+
+static inline uint64_t rdtsc() {
+  uint32_t low;
+  uint32_t high;
+  __asm__ volatile("rdtsc" : "=a"(low), "=d"(high));
+  return ((uint64_t) high << 32) | low;
+}
+
+// Wait out an update in progress and return the sequence number to check reads against
+static inline uint32_t vdso_read_begin() {
+  uint32_t seq;
+
+  while ((seq = __atomic_load_n(&vdso->seq, __ATOMIC_ACQUIRE)) & 1) {
+    __asm__ volatile("pause");
+  }
+
+  return seq;
+}
+
+// Whether the fields read since vdso_read_begin() returned seq were all from one update
+static inline bool vdso_read_retry(uint32_t seq) {
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&vdso->seq, __ATOMIC_RELAXED) != seq;
+}
+
+uint64_t clock_ns() {
+  uint32_t seq;
+  uint64_t ns;
+
+  do {
+    seq = vdso_read_begin();
+    ns = vdso->base_ns + (((rdtsc() - vdso->base_tsc) * vdso->ns_mult) >> VDSO_NS_SHIFT);
+  } while (vdso_read_retry(seq));
+
+  return ns;
+}
+
+int clock_gettime(int clock, struct timespec* ts) {
+  uint64_t ns;
+
+  if (clock == CLOCK_MONOTONIC) {
+    ns = clock_ns();
+  } else if (clock == CLOCK_MONOTONIC_COARSE) {
+    uint32_t seq;
+    uint64_t ticks;
+    uint64_t hz;
+
+    do {
+      seq = vdso_read_begin();
+      ticks = vdso->timer_ticks;
+      hz = vdso->timer_hz;
+    } while (vdso_read_retry(seq));
+
+    ns = ticks * (NS_PER_SEC / hz);
+  } else {
+    return -1;
+  }
+
+  ts->tv_sec = ns / NS_PER_SEC;
+  ts->tv_nsec = ns % NS_PER_SEC;
+
+  return 0;
+}
+
+uint64_t tsc_frequency() {
+  // Set once at boot and never changed
+  return vdso->tsc_frequency;
+}
+
+uint64_t cpu_ticks(uint32_t cpu) {
+  if (cpu >= VDSO_MAX_CPUS) {
+    return 0;
+  }
+
+  return vdso->cpu_ticks[cpu];
+}
+
+uint32_t cpus_online() {
+  uint32_t seq;
+  uint32_t count;
+
+  do {
+    seq = vdso_read_begin();
+    count = vdso->cpu_count;
+  } while (vdso_read_retry(seq));
+
+  return count;
+}
+
+void memory_usage(uint64_t* total_pages, uint64_t* free_pages) {
+  uint32_t seq;
+  uint64_t total;
+  uint64_t free;
+
+  do {
+    seq = vdso_read_begin();
+    total = vdso->total_pages;
+    free = vdso->free_pages;
+  } while (vdso_read_retry(seq));
+
+  if (total_pages != NULL) {
+    *total_pages = total;
+  }
+  if (free_pages != NULL) {
+    *free_pages = free;
+  }
+}
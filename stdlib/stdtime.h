@@ -0,0 +1,35 @@
+#pragma once
+
+#include "stdbool.h"
+#include "stddef.h"
+#include "stdint.h"
+#include "vdso.h"
+
+// Time since boot, from the TSC
+#define CLOCK_MONOTONIC 1
+
+// Time since boot, counted in timer interrupts: cheaper, but only as fine as the timer
+#define CLOCK_MONOTONIC_COARSE 6
+
+struct timespec {
+  int64_t tv_sec;
+  int64_t tv_nsec;
+};
+
+// Read a clock without entering the kernel. Returns 0, or -1 if the clock is not supported.
+int clock_gettime(int clock, struct timespec* ts);
+
+// Nanoseconds since boot, without entering the kernel
+uint64_t clock_ns();
+
+// TSC cycles per second, as calibrated by the kernel at boot
+uint64_t tsc_frequency();
+
+// Timer interrupts taken by a CPU since it started, or 0 for a CPU that does not exist
+uint64_t cpu_ticks(uint32_t cpu);
+
+// How many CPUs are online
+uint32_t cpus_online();
+
+// Pages of physical memory in total and not in use. Either pointer may be NULL.
+void memory_usage(uint64_t* total_pages, uint64_t* free_pages);
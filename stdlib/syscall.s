@@ -1,4 +1,5 @@
 .global syscall
+.global syscall_int80
 
 # This function is called to issue a system call
 # Arguments are:
@@ -13,6 +14,20 @@ syscall:
   # Pull argument 5 up into %rax
   mov 0x8(%rsp), %rax
 
+  # The syscall instruction overwrites %rcx with the return address, so pass arg2 in %r10
+  mov %rcx, %r10
+
+  # Enter the kernel through the fast system call path
+  syscall
+
+  # Return from the function
+  retq
+
+# The same as syscall, through the slower interrupt path
+syscall_int80:
+  # Pull argument 5 up into %rax
+  mov 0x8(%rsp), %rax
+
   # Trigger the system call interrupt
   int $0x80
 
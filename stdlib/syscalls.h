@@ -0,0 +1,82 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define SYSCALL_NAME_SIZE 16
+#define SYSCALL_HISTOGRAM_BUCKETS 32
+
+// What the kernel has counted for one system call, as returned by sys_stats()
+typedef struct syscall_stats {
+  char name[SYSCALL_NAME_SIZE];
+  uint64_t count;
+  uint64_t total_cycles;  // Time spent in the kernel, including any time the caller was blocked
+  uint64_t histogram[SYSCALL_HISTOGRAM_BUCKETS]; // histogram[i] counts calls of 2^i to 2^(i+1) cycles
+} syscall_stats_t;
+
+// Slots in each of a process's submission and completion rings
+#define RING_ENTRIES 32
+
+// One system call queued on the submission ring
+typedef struct ring_sqe {
+  uint32_t number;        // The system call to make
+  uint32_t reserved;
+  uint64_t args[6];
+  uint64_t user_data;     // Copied to the completion, to match it up with this request
+} ring_sqe_t;
+
+// The result of one queued system call, posted on the completion ring
+typedef struct ring_cqe {
+  uint64_t user_data;
+  uint64_t result;
+} ring_cqe_t;
+
+// A process's submission and completion rings, shared with the kernel in one page set up by
+// sys_ring_setup(). The process queues calls at sq_tail, and sys_ring_enter() makes each call
+// from sq_head onwards and posts its result at cq_tail. The process collects results from
+// cq_head. Heads and tails only ever increase; slot i of a ring is at index i % RING_ENTRIES.
+typedef struct ring {
+  volatile uint32_t sq_head;  // Written by the kernel
+  volatile uint32_t sq_tail;  // Written by the process
+  volatile uint32_t cq_head;  // Written by the process
+  volatile uint32_t cq_tail;  // Written by the kernel
+  uint8_t reserved[48];
+  ring_sqe_t sq[RING_ENTRIES];
+  ring_cqe_t cq[RING_ENTRIES];
+} ring_t;
+
+// SYS_WRITE, SYS_READ, ... for every system call
+#define SYSCALL0(constant, number, ret, name) constant = number,
+#define SYSCALL1(constant, number, ret, name, ...) constant = number,
+#define SYSCALL2(constant, number, ret, name, ...) constant = number,
+#define SYSCALL3(constant, number, ret, name, ...) constant = number,
+#define SYSCALL4(constant, number, ret, name, ...) constant = number,
+#define SYSCALL5(constant, number, ret, name, ...) constant = number,
+enum syscall_number {
+#include "syscalls.def"
+};
+#undef SYSCALL0
+#undef SYSCALL1
+#undef SYSCALL2
+#undef SYSCALL3
+#undef SYSCALL4
+#undef SYSCALL5
+
+// SYSCALL_COUNT, one past the highest system call number
+#define SYSCALL0(constant, number, ret, name) SYSCALL_SLOT_##name,
+#define SYSCALL1(constant, number, ret, name, ...) SYSCALL_SLOT_##name,
+#define SYSCALL2(constant, number, ret, name, ...) SYSCALL_SLOT_##name,
+#define SYSCALL3(constant, number, ret, name, ...) SYSCALL_SLOT_##name,
+#define SYSCALL4(constant, number, ret, name, ...) SYSCALL_SLOT_##name,
+#define SYSCALL5(constant, number, ret, name, ...) SYSCALL_SLOT_##name,
+enum syscall_slot {
+#include "syscalls.def"
+  SYSCALL_COUNT
+};
+#undef SYSCALL0
+#undef SYSCALL1
+#undef SYSCALL2
+#undef SYSCALL3
+#undef SYSCALL4
+#undef SYSCALL5
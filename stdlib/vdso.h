@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdint.h>
+
+// Where the kernel maps its read-only data page in every process
+#define VDSO_BASE 0x7FF000000000
+
+// The most CPUs the data page has tick counters for
+#define VDSO_MAX_CPUS 16
+
+// Data the kernel publishes to every process. Apart from cpu_ticks, fields may only be read
+// between two reads of an even, unchanged seq: the kernel makes seq odd while it updates them.
+typedef struct vdso_data {
+  volatile uint32_t seq;
+  uint32_t cpu_count;       // CPUs online
+  uint64_t tsc_frequency;   // TSC cycles per second
+  uint64_t timer_hz;        // Timer interrupts per second
+  uint64_t timer_ticks;     // Timer interrupts since boot
+
+  // Monotonic time is base_ns + (((TSC - base_tsc) * ns_mult) >> VDSO_NS_SHIFT)
+  uint64_t base_tsc;
+  uint64_t base_ns;
+  uint64_t ns_mult;
+
+  uint64_t total_pages;     // Pages of physical memory
+  uint64_t free_pages;      // Pages of physical memory not in use
+
+  // Timer interrupts each CPU has taken. Each counter is written by its own CPU alone and can be
+  // read at any time without checking seq.
+  volatile uint64_t cpu_ticks[VDSO_MAX_CPUS];
+} vdso_data_t;
+
+#define VDSO_NS_SHIFT 32
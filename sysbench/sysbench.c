@@ -0,0 +1,77 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "stdio.h"
+#include "stdsys.h"
+#include "stdring.h"
+
+// Round trips timed for each way into the kernel
+#define SYSBENCH_ROUNDS 100000
+
+static inline uint64_t rdtsc() {
+  uint32_t low;
+  uint32_t high;
+  __asm__ volatile("rdtsc" : "=a"(low), "=d"(high));
+  return ((uint64_t) high << 32) | low;
+}
+
+void _start() {
+
+  // Time zero-length writes, which return straight away
+  char unused = 0;
+
+  uint64_t start = rdtsc();
+  for (int i = 0; i < SYSBENCH_ROUNDS; i++) {
+    syscall_int80(SYS_WRITE, 1, &unused, 0);
+  }
+  uint64_t int80_cycles = rdtsc() - start;
+
+  start = rdtsc();
+  for (int i = 0; i < SYSBENCH_ROUNDS; i++) {
+    syscall(SYS_WRITE, 1, &unused, 0);
+  }
+  uint64_t syscall_cycles = rdtsc() - start;
+
+  start = rdtsc();
+  for (int i = 0; i < SYSBENCH_ROUNDS; i++) {
+    sys_write(1, &unused, 0);
+  }
+  uint64_t inline_cycles = rdtsc() - start;
+
+  // The same writes, queued a ring's worth at a time and made with one kernel entry per batch
+  ring_t* ring = ring_setup();
+  uint64_t ring_cycles = 0;
+
+  if (ring != NULL) {
+    ring_cqe_t cqe;
+
+    start = rdtsc();
+    for (int i = 0; i < SYSBENCH_ROUNDS / RING_ENTRIES; i++) {
+      for (int j = 0; j < RING_ENTRIES; j++) {
+        ring_queue_write(ring, 1, &unused, 0, j);
+      }
+      ring_submit(ring);
+      while (ring_reap(ring, &cqe)) {}
+    }
+    ring_cycles = rdtsc() - start;
+  }
+
+  printf("int $0x80 round trip: %d cycles\n", int80_cycles / SYSBENCH_ROUNDS);
+  printf("syscall round trip: %d cycles\n", syscall_cycles / SYSBENCH_ROUNDS);
+  printf("inline syscall round trip: %d cycles\n", inline_cycles / SYSBENCH_ROUNDS);
+
+  if (ring != NULL) {
+    char message[] = "ring write: this line was written through the submission ring\n";
+
+    printf("ring write, %d per batch: %d cycles\n", RING_ENTRIES,
+           ring_cycles / (SYSBENCH_ROUNDS / RING_ENTRIES * RING_ENTRIES));
+
+    ring_queue_write(ring, 1, message, sizeof(message) - 1, 0);
+    ring_submit(ring);
+  } else {
+    printf("could not set up the submission ring\n");
+  }
+
+  exit();
+}